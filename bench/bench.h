@@ -0,0 +1,54 @@
+#ifndef _BITMAP_BENCH_BENCH_H_
+#define _BITMAP_BENCH_BENCH_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../bitmap.h"
+
+// ----------------------------------------------------------------------------
+// Shared by the benchmarks: each runs a piece of work a few times and reports
+// the best time, which is the least disturbed by the rest of the machine.
+
+/**
+ * Times the best of a number of runs of a piece of work.
+ *
+ * @param anything callable with no arguments
+ * @param number of runs
+ * @return the shortest run, in milliseconds
+**/
+template <typename Work>
+double bestOf(Work work, int runs = 7)
+{
+    double best = 1e30;
+    for (int run = 0; run < runs; run++)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        work();
+        const std::chrono::duration <double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Prints one result as its time and the rate at which it went through bytes.
+inline void report(const char * name, double milliseconds, double bytes)
+{
+    std::printf("  %-28s %9.2f ms %9.1f MB/s\n", name, milliseconds,
+                bytes / milliseconds / 1e3);
+}
+
+// Width and height from the command line, or those given.
+inline void imageSize(int argc, char ** argv, int & width, int & height)
+{
+    if (argc >= 3)
+    {
+        width = std::atoi(argv[1]);
+        height = std::atoi(argv[2]);
+    }
+}
+
+#endif
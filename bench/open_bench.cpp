@@ -0,0 +1,89 @@
+#include "bench.h"
+
+#include <fstream>
+
+// ----------------------------------------------------------------------------
+// Reads a 24-bit file the way open used to, three get() calls and a push_back
+// per pixel, and the way it does now, with one read of the whole pixel array,
+// then times expanding the rows into a PixelMatrix with the scalar and
+// dispatched kernels. Usage: open_bench [width height]
+
+static const char * const FILE_NAME = "open_bench.bmp";
+
+// The original row loop of open, for comparison.
+static PixelMatrix openPerPixel(const char * name)
+{
+    std::ifstream file(name, std::ios::in | std::ios::binary);
+    bmpfile_magic magic;
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+    file.read((char*)(&magic), sizeof(magic));
+    file.read((char*)(&header), sizeof(header));
+    file.read((char*)(&dib_info), sizeof(dib_info));
+    file.seekg(header.bmp_offset);
+
+    PixelMatrix pixels;
+    for (int row = 0; row < dib_info.height; row++)
+    {
+        std::vector <Pixel> row_data;
+        for (int col = 0; col < dib_info.width; col++)
+        {
+            int blue = file.get();
+            int green = file.get();
+            int red = file.get();
+            row_data.push_back(Pixel(red, green, blue));
+        }
+        file.seekg(dib_info.width % 4, std::ios::cur);
+        pixels.insert(pixels.begin(), row_data);
+    }
+    return pixels;
+}
+
+int main(int argc, char ** argv)
+{
+    int width = 4000;
+    int height = 3000;
+    imageSize(argc, argv, width, height);
+
+    Bitmap image(width, height);
+    PixelView <PixelFormat::BGR8> view = image.view <PixelFormat::BGR8> ();
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            view.pixel(y, x) = PackedPixel(x & 255, y & 255, (x ^ y) & 255);
+        }
+    }
+    image.save(FILE_NAME);
+
+    const double bytes = (double)width * height * 3;
+    std::printf("Reading a %dx%d 24-bit file (%.0f MB):\n", width, height, bytes / 1e6);
+
+    Bitmap opened;
+    size_t rows = 0;
+    report("get() per pixel", bestOf([&] { rows += openPerPixel(FILE_NAME).size(); }, 1),
+           bytes);
+    report("open", bestOf([&] { opened.open(FILE_NAME); }), bytes);
+
+    // The same rows expanded into Pixels, as toPixelMatrix does.
+    std::vector <Pixel> row(width);
+    const ExpandRowFunction expandRow = selectExpandRow();
+    report("expand rows, scalar", bestOf([&]
+    {
+        for (int y = 0; y < height; y++)
+        {
+            expandRowScalar(opened.view <PixelFormat::BGR8> ().row(y), &row[0], width);
+        }
+    }), bytes);
+    report("expand rows, dispatched", bestOf([&]
+    {
+        for (int y = 0; y < height; y++)
+        {
+            expandRow(opened.view <PixelFormat::BGR8> ().row(y), &row[0], width);
+        }
+    }), bytes);
+    report("toPixelMatrix", bestOf([&] { rows += opened.toPixelMatrix().size(); }), bytes);
+
+    std::remove(FILE_NAME);
+    return rows != 0 && opened.isImage() ? 0 : 1;
+}
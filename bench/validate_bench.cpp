@@ -0,0 +1,59 @@
+#include "bench.h"
+
+// ----------------------------------------------------------------------------
+// Compares the scalar and vector range checks that Bitmap::validate and
+// fromPixelMatrix run on every row of a PixelMatrix, one kernel at a time
+// and through validate itself. Usage: validate_bench [width height]
+
+int main(int argc, char ** argv)
+{
+    int width = 4000;
+    int height = 3000;
+    imageSize(argc, argv, width, height);
+
+    // Every value is in range, so each check reads the whole matrix.
+    PixelMatrix matrix(height, std::vector <Pixel> (width));
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            matrix[y][x] = Pixel(x & 255, y & 255, (x + y) & 255);
+        }
+    }
+
+    const double bytes = (double)width * height * sizeof(Pixel);
+    bool valid = true;
+    std::printf("Validating a %dx%d PixelMatrix (%.0f MB):\n", width, height, bytes / 1e6);
+
+    // Runs a kernel over every row, as validate does.
+    struct Rows
+    {
+        const PixelMatrix & matrix;
+        PackableRowFunction packable;
+        bool & valid;
+
+        void operator()() const
+        {
+            for (size_t y = 0; y < matrix.size(); y++)
+            {
+                valid = packable(&matrix[y][0], matrix[y].size()) && valid;
+            }
+        }
+    };
+
+    report("scalar", bestOf(Rows { matrix, isPackableRowScalar, valid }), bytes);
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        report("SSE4.1", bestOf(Rows { matrix, isPackableRowSse41, valid }), bytes);
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        report("AVX2", bestOf(Rows { matrix, isPackableRowAvx2, valid }), bytes);
+    }
+#endif
+    report("Bitmap::validate", bestOf([&] { valid = Bitmap::validate(matrix) && valid; }),
+           bytes);
+
+    return valid ? 0 : 1;
+}
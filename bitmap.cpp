@@ -4,12 +4,73 @@
 #include <fstream>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+// The row kernels below come in a portable ...Scalar version and, where a
+// vector unit helps, versions built for one instruction set each. The
+// select... functions pick one at run time from what the CPU supports; the
+// vector versions hand the few pixels at the end of a row that do not fill a
+// register to the scalar version, which is also all that is built when
+// BITMAP_NO_SIMD is defined or the compiler is not targeting x86.
+#if !defined(BITMAP_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) \
+        && (defined(__x86_64__) || defined(__i386__))
+#define BITMAP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BITMAP_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 typedef unsigned char uchar_t;
 
 const int MIN_RGB=0;
 const int MAX_RGB=255;
 const int BMP_MAGIC_ID=2;
+const size_t PIXEL_ALIGNMENT=64;
+const size_t IO_CHUNK_BYTES=1<<20;
+
+// Values of bmpfile_dib_info::compression. The BMP_ prefix keeps them clear of
+// the macros <wingdi.h> defines under the bare BI_ names.
+const uint32_t BMP_BI_RGB=0;
+const uint32_t BMP_BI_RLE8=1;
+const uint32_t BMP_BI_RLE4=2;
+const uint32_t BMP_BI_BITFIELDS=3;
+const uint32_t BMP_BI_ALPHABITFIELDS=6;
+
+// Sizes of the DIB headers that Bitmap tells apart. BITMAPCOREHEADER is the
+// OS/2 and Windows 2 header; the OS/2 2.x header starts like a
+// BITMAPINFOHEADER but has no masks after it; BITMAPV4HEADER has room for an
+// alpha mask.
+const uint32_t BMP_CORE_HEADER_SIZE=12;
+const uint32_t BMP_OS2_HEADER_SIZE=64;
+const uint32_t BMP_V4_HEADER_SIZE=108;
+const uint32_t BMP_V5_HEADER_SIZE=124;
+
+// Largest width or height taken from a file. Anything larger is a corrupt
+// header rather than an image, and is not allowed anywhere near an allocation.
+const int32_t BMP_MAX_DIMENSION=1<<24;
+
+// Largest area taken from the headers of an RLE file. Delta and end of line
+// escapes let a few bytes stand for any number of pixels, so the length of
+// the file puts no bound on the image it claims to hold.
+const uint64_t BMP_MAX_RLE_PIXELS=(uint64_t)1<<28;
+
+// Values of bmpfile_v5_info::cs_type that refer to an ICC profile, prefixed
+// like the compression values since <wingdi.h> defines the bare names.
+const uint32_t BMP_PROFILE_LINKED=0x4C494E4B;
+const uint32_t BMP_PROFILE_EMBEDDED=0x4D424544;
 
 
 /// Windows BMP-specific format data
@@ -49,253 +110,4178 @@ struct bmpfile_dib_info
   uint32_t num_important_colors;  ///< The number of colors used by the bitmap.
 };
 
+/**
+ * @brief The BITMAPCOREHEADER of OS/2 and Windows 2, whose sizes are 16-bit.
+ * Only the fields after header_size are kept here.
+ */
+struct bmpfile_core_info
+{
+  uint16_t width;
+  uint16_t height;                ///< Always stored bottom-up.
+  uint16_t num_planes;
+  uint16_t bits_per_pixel;        ///< Bits per pixel: 1, 4, 8 or 24.
+};
 
 /**
- * @brief Opens a file as its name is provided and reads pixel-by-pixel the colors
- * into a matrix of RGB pixels. 
- * 
- * Any errors will be echo'd to cout but will result in an empty matrix (with no 
- * rows and no columns).
+ * @brief The fields that larger headers add after those of the
+ * BITMAPINFOHEADER. BITMAPV2INFOHEADER ends after the blue mask,
+ * BITMAPV3INFOHEADER after the alpha mask, BITMAPV4HEADER after the gammas
+ * and BITMAPV5HEADER after the reserved field.
  *
- * @param name of the filename to be opened and read as a matrix of pixels
-**/
-void Bitmap::open(std::string filename)
+ * https://msdn.microsoft.com/en-us/library/dd183381%28v=vs.85%29.aspx
+ */
+struct bmpfile_v5_info
 {
-    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
-    
-    if (file.fail())
+  uint32_t red_mask;
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  uint32_t alpha_mask;
+  uint32_t cs_type;               ///< Color space, such as 'sRGB', or a profile.
+  int32_t  endpoints[9];          ///< CIEXYZ of red, green and blue, in 2.30 fixed point.
+  uint32_t gamma_red;
+  uint32_t gamma_green;
+  uint32_t gamma_blue;
+  uint32_t intent;                ///< Rendering intent.
+  uint32_t profile_data;          ///< Offset of the ICC profile from the start of the DIB header.
+  uint32_t profile_size;          ///< Size of the ICC profile in bytes.
+  uint32_t reserved;
+};
+
+
+/**
+ * @brief Allocates a block of memory whose address is a multiple of
+ * PIXEL_ALIGNMENT. The block must be released with alignedFree.
+ *
+ * The address returned by malloc is stored just before the aligned block so
+ * that it can be recovered when freeing.
+ */
+static unsigned char * alignedAlloc(size_t size)
+{
+    unsigned char * raw = static_cast <unsigned char *> (
+            std::malloc(size + PIXEL_ALIGNMENT + sizeof(void *)));
+    if (raw == NULL)
     {
-        std::cout << filename << " could not be opened. Does it exist? "
-                  << "Is it already open by another program?\n";
-        //pixels.resize(0); //make empty if it isn't already
+        throw std::bad_alloc();
     }
-    else
-    {
-        bmpfile_magic magic;
-        file.read((char*)(&magic), sizeof(magic));
-        
-        // Check to make sure that the first two bytes of the file are the "BM"
-        // identifier that identifies a bitmap image.
-        if (magic.magic[0] != 'B' || magic.magic[1] != 'M')
-        {
-            std::cout << filename << " is not in proper BMP format; it does "
-                                  << "not begin with the magic bytes!\n";
-        }
-        else
-        {
-            // clear data if already holds information
-            for(int i = 0; i < pixels.size(); ++i)
-            {
-                pixels[i].clear();
-            }
-            pixels.clear();
 
-            bmpfile_header header;
-            file.read((char*)(&header), sizeof(header));
+    uintptr_t address = reinterpret_cast <uintptr_t> (raw) + sizeof(void *);
+    address = (address + PIXEL_ALIGNMENT - 1) & ~(uintptr_t)(PIXEL_ALIGNMENT - 1);
 
-            bmpfile_dib_info dib_info;
-            file.read((char*)(&dib_info), sizeof(dib_info));
+    unsigned char * aligned = reinterpret_cast <unsigned char *> (address);
+    reinterpret_cast <void **> (aligned)[-1] = raw;
+    return aligned;
+}
 
-            // Check for this here and so that we know later whether we need to insert
-            // each row at the bottom or top of the image.
-            bool flip = true;
-            if (dib_info.height < 0)
-            {
-                flip = false;
-                dib_info.height = -dib_info.height;
-            }
+/**
+ * @brief Releases a block of memory obtained from alignedAlloc.
+ */
+static void alignedFree(unsigned char * aligned)
+{
+    if (aligned != NULL)
+    {
+        std::free(reinterpret_cast <void **> (aligned)[-1]);
+    }
+}
 
-            // Only support for 24-bit images
-            if (dib_info.bits_per_pixel != 24)
-            {
-                std::cout<<filename<<" uses "<<dib_info.bits_per_pixel
-                         <<"bits per pixel (bit depth). Bitmap only supports 24bit.\n";
-            }
+/**
+ * @brief Stands in for alignedFree for pixels that belong to someone else,
+ * which are left alone when the last buffer referring to them lets go.
+ */
+static void keepExternal(unsigned char *)
+{
+}
 
-            // No support for compressed images
-            if (dib_info.compression != 0)
-            {
-                std::cout<<filename<<" is compressed. "
-                         <<"Bitmap only supports uncompressed images.\n";
-            }
+/**
+ * @brief Expands a row of PackedPixels into Pixels with int components.
+ */
+static void expandRowScalar(const PackedPixel * source, Pixel * target, int count)
+{
+    for (int col = 0; col < count; col++)
+    {
+        target[col].blue = source[col].blue;
+        target[col].green = source[col].green;
+        target[col].red = source[col].red;
+    }
+}
 
-            file.seekg(header.bmp_offset);
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Expands a row of PackedPixels into Pixels, four at a time.
+ *
+ * Each group of four pixels is twelve bytes of BGR data that become twelve
+ * ints (three vectors) in red, green, blue order. A byte shuffle picks the
+ * bytes for each int and zeroes the upper three bytes in one instruction.
+ */
+__attribute__((target("ssse3")))
+static void expandRowSsse3(const PackedPixel * source, Pixel * target, int count)
+{
+    const __m128i first = _mm_setr_epi8(2, -1, -1, -1, 1, -1, -1, -1,
+                                        0, -1, -1, -1, 5, -1, -1, -1);
+    const __m128i second = _mm_setr_epi8(4, -1, -1, -1, 3, -1, -1, -1,
+                                         8, -1, -1, -1, 7, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(6, -1, -1, -1, 11, -1, -1, -1,
+                                        10, -1, -1, -1, 9, -1, -1, -1);
+    int col = 0;
 
-            // Read the pixels for each row and column of Pixels in the image.
-            for (int row = 0; row < dib_info.height; row++)
-            {
-                std::vector <Pixel> row_data;
+    // Each load reads 16 bytes but only uses 12, so stop while a whole load
+    // still fits inside the row.
+    for (; col + 6 <= count; col += 4)
+    {
+        __m128i bgr = _mm_loadu_si128((const __m128i *)(source + col));
+        __m128i * out = (__m128i *)(target + col);
 
-                for (int col = 0; col < dib_info.width; col++)
-                {
-                    int blue = file.get();
-                    int green = file.get();
-                    int red = file.get();
+        _mm_storeu_si128(out, _mm_shuffle_epi8(bgr, first));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(bgr, second));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(bgr, third));
+    }
 
-                    row_data.push_back( Pixel(red, green, blue) );
-                }
+    expandRowScalar(source + col, target + col, count - col);
+}
+#endif
 
-                // Rows are padded so that they're always a multiple of 4
-                // bytes. This line skips the padding at the end of each row.
-                file.seekg(dib_info.width % 4, std::ios::cur);
+typedef void (*ExpandRowFunction)(const PackedPixel *, Pixel *, int);
 
-                if (flip)
-                {
-                    pixels.insert(pixels.begin(), row_data);
-                }
-                else
-                {
-                    pixels.push_back(row_data);
-                }
-            }
+/**
+ * @brief Picks the fastest row expansion kernel the running CPU supports.
+ */
+static ExpandRowFunction selectExpandRow()
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return expandRowSsse3;
+    }
+#endif
+    return expandRowScalar;
+}
 
-            file.close();
-        }//end else (is an image)
-    }//end else (can open file)
+/**
+ * @brief Packs a row of Pixels into PackedPixels.
+ *
+ * The Pixels must already be known to hold values between 0 and 255.
+ */
+static void packRowScalar(const Pixel * source, PackedPixel * target, int count)
+{
+    for (int col = 0; col < count; col++)
+    {
+        target[col].blue = (uint8_t)(source[col].blue);
+        target[col].green = (uint8_t)(source[col].green);
+        target[col].red = (uint8_t)(source[col].red);
+    }
 }
 
-// ----------------------------------------------------------------------------
+#ifdef BITMAP_SIMD_X86
 /**
- * Saves the current image, represented by the matrix of pixels, as a
- * Windows BMP file with the name provided by the parameter. File extension
- * is not forced but should be .bmp. Any errors will cout and will NOT 
- * attempt to save the file.
+ * @brief Packs a row of Pixels into PackedPixels, four at a time.
  *
- * @param name of the filename to be written as a bmp image
-**/
-void Bitmap::save(std::string filename)
+ * The reverse of expandRowSsse3: the low byte of each of the twelve ints
+ * of four Pixels is shuffled into its place among twelve bytes of BGR data.
+ */
+__attribute__((target("ssse3")))
+static void packRowSsse3(const Pixel * source, PackedPixel * target, int count)
 {
-    std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+    const __m128i first = _mm_setr_epi8(8, 4, 0, -1, -1, 12, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i second = _mm_setr_epi8(-1, -1, -1, 4, 0, -1, -1, 12,
+                                         8, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i third = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, -1,
+                                        -1, 12, 8, 4, -1, -1, -1, -1);
+    int col = 0;
 
-    if (file.fail())
+    // Each store writes 16 bytes but only 12 are kept, so stop while a whole
+    // store still fits inside the row.
+    for (; col + 6 <= count; col += 4)
     {
-        std::cout<<filename<<" could not be opened for editing. "
-                 <<"Is it already open by another program or is it read-only?\n";
-        
+        const __m128i * in = (const __m128i *)(source + col);
+        __m128i bgr = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128(in), first),
+                             _mm_shuffle_epi8(_mm_loadu_si128(in + 1), second)),
+                _mm_shuffle_epi8(_mm_loadu_si128(in + 2), third));
+
+        _mm_storeu_si128((__m128i *)(target + col), bgr);
     }
-    else if( !isImage() )
+
+    packRowScalar(source + col, target + col, count - col);
+}
+#endif
+
+typedef void (*PackRowFunction)(const Pixel *, PackedPixel *, int);
+
+/**
+ * @brief Picks the fastest row packing kernel the running CPU supports.
+ */
+static PackRowFunction selectPackRow()
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
     {
-        std::cout<<"Bitmap cannot be saved. It is not a valid image.\n";
+        return packRowSsse3;
     }
-    else
+#endif
+    return packRowScalar;
+}
+
+/**
+ * @brief Checks that every component of a row of Pixels is between 0 and 255,
+ * so that the row can be packed into PackedPixels without losing anything.
+ */
+static bool isPackableRowScalar(const Pixel * source, int count)
+{
+    for (int col = 0; col < count; col++)
     {
-        // Write all the header information that the BMP file format requires.
-        bmpfile_magic magic;
-        magic.magic[0] = 'B';
-        magic.magic[1] = 'M';
-        file.write((char*)(&magic), sizeof(magic));
-        bmpfile_header header = { 0 };
-        header.bmp_offset = sizeof(bmpfile_magic)
-                + sizeof(bmpfile_header) + sizeof(bmpfile_dib_info);
-        header.file_size = header.bmp_offset
-                + (pixels.size() * 3 + pixels[0].size() % 4) * pixels.size();
-        file.write((char*)(&header), sizeof(header));
-        bmpfile_dib_info dib_info = { 0 };
-        dib_info.header_size = sizeof(bmpfile_dib_info);
-        dib_info.width = pixels[0].size();
-        dib_info.height = pixels.size();
-        dib_info.num_planes = 1;
-        dib_info.bits_per_pixel = 24;
-        dib_info.compression = 0;
-        dib_info.bmp_byte_size = 0;
-        dib_info.hres = 2835;
-        dib_info.vres = 2835;
-        dib_info.num_colors = 0;
-        dib_info.num_important_colors = 0;
-        file.write((char*)(&dib_info), sizeof(dib_info));
+        const Pixel & current = source[col];
+        if( current.red > MAX_RGB || current.red < MIN_RGB ||
+              current.green > MAX_RGB || current.green < MIN_RGB ||
+              current.blue > MAX_RGB || current.blue < MIN_RGB )
+            return false;
+    }
+    return true;
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Checks the range of a row of Pixels, four ints at a time.
+ *
+ * An int is between 0 and 255 exactly when none of its bits above the lowest
+ * eight are set, which also catches negative values. The components of a row
+ * are one array of ints, so they are OR'd together a block at a time and the
+ * high bits of the result tested once per block.
+ */
+__attribute__((target("sse4.1")))
+static bool isPackableRowSse41(const Pixel * source, int count)
+{
+    const __m128i high = _mm_set1_epi32(~MAX_RGB);
+    const int * in = &source[0].red;
+    const int total = count * 3;
+    int i = 0;
 
-        // Write each row and column of Pixels into the image file -- we write
-        // the rows upside-down to satisfy the easiest BMP format.
-        for (int row = pixels.size() - 1; row >= 0; row--)
+    // Blocks of 24 ints are a whole number of Pixels as well as of vectors.
+    for (; i + 24 <= total; i += 24)
+    {
+        const __m128i * block = (const __m128i *)(in + i);
+        __m128i any = _mm_or_si128(
+                _mm_or_si128(
+                        _mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+                        _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3))),
+                _mm_or_si128(_mm_loadu_si128(block + 4), _mm_loadu_si128(block + 5)));
+        if (!_mm_testz_si128(any, high))
         {
-            const std::vector <Pixel> & row_data = pixels[row];
+            return false;
+        }
+    }
 
-            for (int col = 0; col < row_data.size(); col++)
-            {
-                const Pixel& pix = row_data[col];
+    return isPackableRowScalar(source + i / 3, count - i / 3);
+}
 
-                file.put((uchar_t)(pix.blue));
-                file.put((uchar_t)(pix.green));
-                file.put((uchar_t)(pix.red));
-            }
+/**
+ * @brief Checks the range of a row of Pixels, eight ints at a time.
+ */
+__attribute__((target("avx2")))
+static bool isPackableRowAvx2(const Pixel * source, int count)
+{
+    const __m256i high = _mm256_set1_epi32(~MAX_RGB);
+    const int * in = &source[0].red;
+    const int total = count * 3;
+    int i = 0;
 
-            // Rows are padded so that they're always a multiple of 4
-            // bytes. This line skips the padding at the end of each row.
-            for (int i = 0; i < row_data.size() % 4; i++)
-            {
-                file.put(0);
-            }
+    // Blocks of 48 ints are a whole number of Pixels as well as of vectors.
+    for (; i + 48 <= total; i += 48)
+    {
+        const __m256i * block = (const __m256i *)(in + i);
+        __m256i any = _mm256_or_si256(
+                _mm256_or_si256(
+                        _mm256_or_si256(_mm256_loadu_si256(block),
+                                        _mm256_loadu_si256(block + 1)),
+                        _mm256_or_si256(_mm256_loadu_si256(block + 2),
+                                        _mm256_loadu_si256(block + 3))),
+                _mm256_or_si256(_mm256_loadu_si256(block + 4),
+                                _mm256_loadu_si256(block + 5)));
+        if (!_mm256_testz_si256(any, high))
+        {
+            return false;
         }
+    }
 
-        file.close();
+    return isPackableRowScalar(source + i / 3, count - i / 3);
+}
+#endif
+
+typedef bool (*PackableRowFunction)(const Pixel *, int);
+
+/**
+ * @brief Picks the fastest range check the running CPU supports. The vector
+ * versions read the components of a row as one array of ints, which they are
+ * when Pixel holds nothing but its three ints.
+ */
+static PackableRowFunction selectPackableRow()
+{
+#ifdef BITMAP_SIMD_X86
+    if (sizeof(Pixel) == 3 * sizeof(int))
+    {
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return isPackableRowAvx2;
+        }
+        if (__builtin_cpu_supports("sse4.1"))
+        {
+            return isPackableRowSse41;
+        }
     }
+#endif
+    return isPackableRowScalar;
 }
-    
-// ----------------------------------------------------------------------------
+
 /**
-  * Validates whether or not the current matrix of pixels represents a
-  * proper image with non-zero-size rows and consistent non-zero-size
-  * columns for each row. In addition, each pixel in the matrix is validated
-  * to have red, green, and blue components with values between 0 and 255
-  *
-  * @return boolean value of whether or not the matrix is a valid image
- **/
-bool Bitmap::isImage()
+ * @brief Checks that every component of a row of Pixels is between 0 and 255,
+ * so that the row can be packed into PackedPixels without losing anything.
+ */
+static bool isPackableRow(const Pixel * source, int count)
+{
+    static const PackableRowFunction packableRow = selectPackableRow();
+    return packableRow(source, count);
+}
+
+typedef void (*ConvertRowFunction)(const void *, void *, int);
+
+/**
+ * @brief Untyped entry point to the convertRow specialization for a pair of
+ * formats, so that it can be picked at run time.
+ */
+template <PixelFormat From, PixelFormat To>
+static void convertRowBytes(const void * source, void * target, int count)
 {
-    const int height = pixels.size();
+    convertRow <From, To> (
+            static_cast <const typename PixelFormatTraits <From>::pixel_type *> (source),
+            static_cast <typename PixelFormatTraits <To>::pixel_type *> (target), count);
+}
 
-    if( height == 0 || pixels[0].size() == 0)
+template <PixelFormat From>
+static ConvertRowFunction selectConvertRowFrom(PixelFormat to)
+{
+    switch (to)
     {
-        return false;
+        case PixelFormat::BGR8:   return convertRowBytes <From, PixelFormat::BGR8>;
+        case PixelFormat::RGB8:   return convertRowBytes <From, PixelFormat::RGB8>;
+        case PixelFormat::BGRA8:  return convertRowBytes <From, PixelFormat::BGRA8>;
+        case PixelFormat::GRAY8:  return convertRowBytes <From, PixelFormat::GRAY8>;
+        case PixelFormat::GRAY16: return convertRowBytes <From, PixelFormat::GRAY16>;
+        case PixelFormat::RGB16:  return convertRowBytes <From, PixelFormat::RGB16>;
+        case PixelFormat::RGBA16: return convertRowBytes <From, PixelFormat::RGBA16>;
+        case PixelFormat::RGBF32: return convertRowBytes <From, PixelFormat::RGBF32>;
+    }
+    return NULL;
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Swaps the first and third bytes of each of sixteen pixels of N
+ * 8-bit channels, held in N vectors.
+ *
+ * Four-byte pixels never straddle two vectors, so each is shuffled on its
+ * own. Three-byte pixels do, and each vector gathers the bytes that land in it
+ * from its neighbours too, with shuffles that zero the bytes they do not
+ * provide.
+ */
+template <int N>
+__attribute__((target("ssse3")))
+static inline void swapRedBlue8(__m128i * bytes)
+{
+    if (N == 4)
+    {
+        const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                            10, 9, 8, 11, 14, 13, 12, 15);
+        for (int v = 0; v < N; v++)
+        {
+            bytes[v] = _mm_shuffle_epi8(bytes[v], order);
+        }
+    }
+    else if (N == 3)
+    {
+        const __m128i a = bytes[0];
+        const __m128i b = bytes[1];
+        const __m128i c = bytes[2];
+
+        bytes[0] = _mm_or_si128(
+                _mm_shuffle_epi8(a, _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7,
+                                                  6, 11, 10, 9, 14, 13, 12, -1)),
+                _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                                  -1, -1, -1, -1, -1, -1, -1, 1)));
+        bytes[1] = _mm_or_si128(
+                _mm_or_si128(
+                        _mm_shuffle_epi8(a, _mm_setr_epi8(-1, 15, -1, -1, -1, -1, -1, -1,
+                                                          -1, -1, -1, -1, -1, -1, -1, -1)),
+                        _mm_shuffle_epi8(b, _mm_setr_epi8(0, -1, 4, 3, 2, 7, 6, 5,
+                                                          10, 9, 8, 13, 12, 11, -1, 15))),
+                _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                                  -1, -1, -1, -1, -1, -1, 0, -1)));
+        bytes[2] = _mm_or_si128(
+                _mm_shuffle_epi8(b, _mm_setr_epi8(14, -1, -1, -1, -1, -1, -1, -1,
+                                                  -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(c, _mm_setr_epi8(-1, 3, 2, 1, 6, 5, 4, 9,
+                                                  8, 7, 12, 11, 10, 15, 14, 13)));
     }
+}
+
+/**
+ * @brief Narrows eight 16-bit channels to 8 bits, rounding v / 257 to the
+ * nearest integer exactly as convertChannel does. With t = v + 128, saturated
+ * at 65535, the result is (t - t / 256) / 256.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i narrowChannels(__m128i v)
+{
+    const __m128i t = _mm_adds_epu16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_sub_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
 
-    const int width = pixels[0].size();
+/**
+ * @brief Converts a row of pixels with 16-bit channels to a format with the
+ * same channels at 8 bits, in the same order or with red and blue swapped,
+ * sixteen pixels at a time.
+ *
+ * The 16-bit channels of sixteen pixels are 2N vectors, which narrow and
+ * pack into N vectors of bytes.
+ */
+template <PixelFormat From, PixelFormat To>
+__attribute__((target("ssse3")))
+static void narrowRowSsse3(const void * source, void * target, int count)
+{
+    const int N = PixelFormatTraits <From>::channels;
+    const uint16_t * in = static_cast <const uint16_t *> (source);
+    uint8_t * out = static_cast <uint8_t *> (target);
+    int col = 0;
 
-    for(int row=0; row < height; row++)
+    for (; col + 16 <= count; col += 16)
     {
-        if( pixels[row].size() != width )
+        const __m128i * block = (const __m128i *)(in + col * N);
+        __m128i bytes[N];
+
+        for (int v = 0; v < N; v++)
         {
-            return false;
+            bytes[v] = _mm_packus_epi16(narrowChannels(_mm_loadu_si128(block + 2 * v)),
+                                        narrowChannels(_mm_loadu_si128(block + 2 * v + 1)));
         }
-        for(int column=0; column < width; column++)
+        if (PixelFormatTraits <From>::red != PixelFormatTraits <To>::red)
         {
-            Pixel current = pixels[row][column];
-            if( current.red > MAX_RGB || current.red < MIN_RGB ||
-                  current.green > MAX_RGB || current.green < MIN_RGB ||
-                  current.blue > MAX_RGB || current.blue < MIN_RGB )
-                return false;
+            swapRedBlue8 <N> (bytes);
+        }
+        for (int v = 0; v < N; v++)
+        {
+            _mm_storeu_si128((__m128i *)(out + col * N) + v, bytes[v]);
         }
     }
-    return true;
+
+    convertRowBytes <From, To> (in + col * N, out + col * N, count - col);
 }
 
-// ----------------------------------------------------------------------------
 /**
- * Provides a vector of vector of pixels representing the bitmap
- *
- * @return the bitmap image, represented by a matrix of RGB pixels
-**/
-PixelMatrix Bitmap::toPixelMatrix()
+ * @brief Converts a row of pixels with 8-bit channels to a format with the
+ * same channels at 16 bits, sixteen pixels at a time. Each byte is widened by
+ * interleaving it with itself, which is the same as multiplying it by 257.
+ */
+template <PixelFormat From, PixelFormat To>
+__attribute__((target("ssse3")))
+static void widenRowSsse3(const void * source, void * target, int count)
 {
-    if( isImage() )
+    const int N = PixelFormatTraits <From>::channels;
+    const uint8_t * in = static_cast <const uint8_t *> (source);
+    uint16_t * out = static_cast <uint16_t *> (target);
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
     {
-        return pixels;
-    }   
-    else
+        const __m128i * block = (const __m128i *)(in + col * N);
+        __m128i * result = (__m128i *)(out + col * N);
+        __m128i bytes[N];
+
+        for (int v = 0; v < N; v++)
+        {
+            bytes[v] = _mm_loadu_si128(block + v);
+        }
+        if (PixelFormatTraits <From>::red != PixelFormatTraits <To>::red)
+        {
+            swapRedBlue8 <N> (bytes);
+        }
+        for (int v = 0; v < N; v++)
+        {
+            _mm_storeu_si128(result + 2 * v, _mm_unpacklo_epi8(bytes[v], bytes[v]));
+            _mm_storeu_si128(result + 2 * v + 1, _mm_unpackhi_epi8(bytes[v], bytes[v]));
+        }
+    }
+
+    convertRowBytes <From, To> (in + col * N, out + col * N, count - col);
+}
+
+/**
+ * @brief Picks a vector kernel for the pairs of formats that differ only in
+ * the size of their channels, and perhaps the order of red and blue: the
+ * narrowing and widening done around 16-bit images. Returns NULL for other
+ * pairs, or when the running CPU lacks SSSE3.
+ */
+static ConvertRowFunction selectConvertRowSsse3(PixelFormat from, PixelFormat to)
+{
+    if (!__builtin_cpu_supports("ssse3"))
+    {
+        return NULL;
+    }
+
+    switch (from)
     {
-        return PixelMatrix();
-    }   
+        case PixelFormat::GRAY16:
+            return to == PixelFormat::GRAY8
+                    ? narrowRowSsse3 <PixelFormat::GRAY16, PixelFormat::GRAY8>
+                    : NULL;
+        case PixelFormat::RGB16:
+            return to == PixelFormat::RGB8
+                    ? narrowRowSsse3 <PixelFormat::RGB16, PixelFormat::RGB8>
+                    : to == PixelFormat::BGR8
+                    ? narrowRowSsse3 <PixelFormat::RGB16, PixelFormat::BGR8>
+                    : NULL;
+        case PixelFormat::RGBA16:
+            return to == PixelFormat::BGRA8
+                    ? narrowRowSsse3 <PixelFormat::RGBA16, PixelFormat::BGRA8>
+                    : NULL;
+        case PixelFormat::GRAY8:
+            return to == PixelFormat::GRAY16
+                    ? widenRowSsse3 <PixelFormat::GRAY8, PixelFormat::GRAY16>
+                    : NULL;
+        case PixelFormat::RGB8:
+            return to == PixelFormat::RGB16
+                    ? widenRowSsse3 <PixelFormat::RGB8, PixelFormat::RGB16>
+                    : NULL;
+        case PixelFormat::BGR8:
+            return to == PixelFormat::RGB16
+                    ? widenRowSsse3 <PixelFormat::BGR8, PixelFormat::RGB16>
+                    : NULL;
+        case PixelFormat::BGRA8:
+            return to == PixelFormat::RGBA16
+                    ? widenRowSsse3 <PixelFormat::BGRA8, PixelFormat::RGBA16>
+                    : NULL;
+        default:
+            return NULL;
+    }
 }
+#endif
 
-// ----------------------------------------------------------------------------
 /**
- * Overwrites the current bitmap with that represented by a matrix of
- * pixels. Does not validate that the new matrix of pixels is a proper
- * image.
- *
- * @param a matrix of pixels to represent a bitmap
-**/
-void Bitmap::fromPixelMatrix(const PixelMatrix & values)
+ * @brief Looks up the compiled row conversion for a pair of formats, or a
+ * vector kernel for it when there is one, so that the choice is made once per
+ * image rather than once per pixel.
+ */
+static ConvertRowFunction selectConvertRow(PixelFormat from, PixelFormat to)
 {
-    pixels = values;
+#ifdef BITMAP_SIMD_X86
+    const ConvertRowFunction vector = selectConvertRowSsse3(from, to);
+    if (vector != NULL)
+    {
+        return vector;
+    }
+#endif
+
+    switch (from)
+    {
+        case PixelFormat::BGR8:   return selectConvertRowFrom <PixelFormat::BGR8> (to);
+        case PixelFormat::RGB8:   return selectConvertRowFrom <PixelFormat::RGB8> (to);
+        case PixelFormat::BGRA8:  return selectConvertRowFrom <PixelFormat::BGRA8> (to);
+        case PixelFormat::GRAY8:  return selectConvertRowFrom <PixelFormat::GRAY8> (to);
+        case PixelFormat::GRAY16: return selectConvertRowFrom <PixelFormat::GRAY16> (to);
+        case PixelFormat::RGB16:  return selectConvertRowFrom <PixelFormat::RGB16> (to);
+        case PixelFormat::RGBA16: return selectConvertRowFrom <PixelFormat::RGBA16> (to);
+        case PixelFormat::RGBF32: return selectConvertRowFrom <PixelFormat::RGBF32> (to);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Splits a row of interleaved pixels into one row per channel.
+ *
+ * Handles every format; the vector versions cover BGR8, RGB8 and BGRA8.
+ */
+template <typename T, int N>
+static void splitRowScalar(const unsigned char * source, unsigned char * const * planes,
+                           int count)
+{
+    const T * in = reinterpret_cast <const T *> (source);
+
+    for (int c = 0; c < N; c++)
+    {
+        T * out = reinterpret_cast <T *> (planes[c]);
+        for (int col = 0; col < count; col++)
+        {
+            out[col] = in[col * N + c];
+        }
+    }
+}
+
+/**
+ * @brief Merges one row per channel back into a row of interleaved pixels.
+ */
+template <typename T, int N>
+static void mergeRowScalar(const unsigned char * const * planes, unsigned char * target,
+                           int count)
+{
+    T * out = reinterpret_cast <T *> (target);
+
+    for (int c = 0; c < N; c++)
+    {
+        const T * in = reinterpret_cast <const T *> (planes[c]);
+        for (int col = 0; col < count; col++)
+        {
+            out[col * N + c] = in[col];
+        }
+    }
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Separates the 48 bytes of sixteen three-byte pixels, held in three
+ * vectors, into one vector per channel.
+ *
+ * Each channel gathers its bytes from all three vectors with one shuffle
+ * apiece, and the shuffles zero every byte that belongs to another channel so
+ * the results can simply be OR'd.
+ */
+__attribute__((target("ssse3")))
+static inline void deinterleave3(const __m128i * pixels, __m128i * channels)
+{
+    const __m128i mask[3][3] = {
+        { _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13) },
+        { _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14) },
+        { _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+          _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) }
+    };
+
+    for (int p = 0; p < 3; p++)
+    {
+        channels[p] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(pixels[0], mask[p][0]),
+                             _mm_shuffle_epi8(pixels[1], mask[p][1])),
+                _mm_shuffle_epi8(pixels[2], mask[p][2]));
+    }
+}
+
+/**
+ * @brief Interleaves three vectors of sixteen bytes, one per channel, into
+ * the 48 bytes of sixteen three-byte pixels. The reverse of deinterleave3.
+ */
+__attribute__((target("ssse3")))
+static inline void interleave3(const __m128i * channels, __m128i * pixels)
+{
+    const __m128i mask[3][3] = {
+        { _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5),
+          _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1),
+          _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1) },
+        { _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1),
+          _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10),
+          _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1) },
+        { _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1),
+          _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1),
+          _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15) }
+    };
+
+    for (int v = 0; v < 3; v++)
+    {
+        pixels[v] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(channels[0], mask[v][0]),
+                             _mm_shuffle_epi8(channels[1], mask[v][1])),
+                _mm_shuffle_epi8(channels[2], mask[v][2]));
+    }
+}
+
+/**
+ * @brief Splits a row of three-byte pixels into three planes, sixteen pixels
+ * at a time, with deinterleave3.
+ */
+__attribute__((target("ssse3")))
+static void splitRow3Ssse3(const unsigned char * source, unsigned char * const * planes,
+                           int count)
+{
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i * in = (const __m128i *)(source + col * 3);
+        const __m128i pixels[3] = { _mm_loadu_si128(in), _mm_loadu_si128(in + 1),
+                                    _mm_loadu_si128(in + 2) };
+        __m128i channels[3];
+
+        deinterleave3(pixels, channels);
+        for (int p = 0; p < 3; p++)
+        {
+            _mm_storeu_si128((__m128i *)(planes[p] + col), channels[p]);
+        }
+    }
+
+    unsigned char * const rest[3] = { planes[0] + col, planes[1] + col, planes[2] + col };
+    splitRowScalar <uint8_t, 3> (source + col * 3, rest, count - col);
+}
+
+/**
+ * @brief Merges three planes into a row of three-byte pixels, sixteen pixels
+ * at a time, with interleave3. The reverse of splitRow3Ssse3.
+ */
+__attribute__((target("ssse3")))
+static void mergeRow3Ssse3(const unsigned char * const * planes, unsigned char * target,
+                           int count)
+{
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i channels[3] = {
+                _mm_loadu_si128((const __m128i *)(planes[0] + col)),
+                _mm_loadu_si128((const __m128i *)(planes[1] + col)),
+                _mm_loadu_si128((const __m128i *)(planes[2] + col)) };
+        __m128i pixels[3];
+
+        interleave3(channels, pixels);
+        for (int v = 0; v < 3; v++)
+        {
+            _mm_storeu_si128((__m128i *)(target + col * 3) + v, pixels[v]);
+        }
+    }
+
+    const unsigned char * const rest[3] = { planes[0] + col, planes[1] + col,
+                                            planes[2] + col };
+    mergeRowScalar <uint8_t, 3> (rest, target + col * 3, count - col);
+}
+
+/**
+ * @brief Splits a row of four-byte pixels into four planes, sixteen pixels
+ * at a time.
+ *
+ * A shuffle groups the bytes of each channel of four pixels into one 32-bit
+ * lane, and a 4x4 transpose of the lanes of four vectors then leaves each
+ * channel of all sixteen pixels in a vector of its own.
+ */
+__attribute__((target("ssse3")))
+static void splitRow4Ssse3(const unsigned char * source, unsigned char * const * planes,
+                           int count)
+{
+    const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                        2, 6, 10, 14, 3, 7, 11, 15);
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i * in = (const __m128i *)(source + col * 4);
+        const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(in), group);
+        const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), group);
+        const __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), group);
+        const __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), group);
+
+        const __m128i ab_low = _mm_unpacklo_epi32(a, b);
+        const __m128i ab_high = _mm_unpackhi_epi32(a, b);
+        const __m128i cd_low = _mm_unpacklo_epi32(c, d);
+        const __m128i cd_high = _mm_unpackhi_epi32(c, d);
+
+        _mm_storeu_si128((__m128i *)(planes[0] + col), _mm_unpacklo_epi64(ab_low, cd_low));
+        _mm_storeu_si128((__m128i *)(planes[1] + col), _mm_unpackhi_epi64(ab_low, cd_low));
+        _mm_storeu_si128((__m128i *)(planes[2] + col), _mm_unpacklo_epi64(ab_high, cd_high));
+        _mm_storeu_si128((__m128i *)(planes[3] + col), _mm_unpackhi_epi64(ab_high, cd_high));
+    }
+
+    unsigned char * const rest[4] = { planes[0] + col, planes[1] + col,
+                                      planes[2] + col, planes[3] + col };
+    splitRowScalar <uint8_t, 4> (source + col * 4, rest, count - col);
+}
+
+/**
+ * @brief Merges four planes into a row of four-byte pixels, sixteen pixels
+ * at a time. The transpose and shuffle of splitRow4Ssse3 are their own
+ * inverses, so this applies them in the opposite order.
+ */
+__attribute__((target("ssse3")))
+static void mergeRow4Ssse3(const unsigned char * const * planes, unsigned char * target,
+                           int count)
+{
+    const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                        2, 6, 10, 14, 3, 7, 11, 15);
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + col));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + col));
+        const __m128i c = _mm_loadu_si128((const __m128i *)(planes[2] + col));
+        const __m128i d = _mm_loadu_si128((const __m128i *)(planes[3] + col));
+
+        const __m128i ab_low = _mm_unpacklo_epi32(a, b);
+        const __m128i ab_high = _mm_unpackhi_epi32(a, b);
+        const __m128i cd_low = _mm_unpacklo_epi32(c, d);
+        const __m128i cd_high = _mm_unpackhi_epi32(c, d);
+        __m128i * out = (__m128i *)(target + col * 4);
+
+        _mm_storeu_si128(out, _mm_shuffle_epi8(_mm_unpacklo_epi64(ab_low, cd_low), group));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(_mm_unpackhi_epi64(ab_low, cd_low), group));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(_mm_unpacklo_epi64(ab_high, cd_high), group));
+        _mm_storeu_si128(out + 3, _mm_shuffle_epi8(_mm_unpackhi_epi64(ab_high, cd_high), group));
+    }
+
+    const unsigned char * const rest[4] = { planes[0] + col, planes[1] + col,
+                                            planes[2] + col, planes[3] + col };
+    mergeRowScalar <uint8_t, 4> (rest, target + col * 4, count - col);
+}
+#endif
+
+typedef void (*SplitRowFunction)(const unsigned char *, unsigned char * const *, int);
+typedef void (*MergeRowFunction)(const unsigned char * const *, unsigned char *, int);
+
+/**
+ * @brief Picks the fastest kernel the running CPU supports for splitting rows
+ * of a format into planes.
+ */
+static SplitRowFunction selectSplitRow(PixelFormat format)
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        if (format == PixelFormat::BGR8 || format == PixelFormat::RGB8)
+        {
+            return splitRow3Ssse3;
+        }
+        if (format == PixelFormat::BGRA8)
+        {
+            return splitRow4Ssse3;
+        }
+    }
+#endif
+    switch (format)
+    {
+        case PixelFormat::BGR8:
+        case PixelFormat::RGB8:   return splitRowScalar <uint8_t, 3>;
+        case PixelFormat::BGRA8:  return splitRowScalar <uint8_t, 4>;
+        case PixelFormat::GRAY8:  return splitRowScalar <uint8_t, 1>;
+        case PixelFormat::GRAY16: return splitRowScalar <uint16_t, 1>;
+        case PixelFormat::RGB16:  return splitRowScalar <uint16_t, 3>;
+        case PixelFormat::RGBA16: return splitRowScalar <uint16_t, 4>;
+        case PixelFormat::RGBF32: return splitRowScalar <float, 3>;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Picks the fastest kernel the running CPU supports for merging planes
+ * back into rows of a format.
+ */
+static MergeRowFunction selectMergeRow(PixelFormat format)
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        if (format == PixelFormat::BGR8 || format == PixelFormat::RGB8)
+        {
+            return mergeRow3Ssse3;
+        }
+        if (format == PixelFormat::BGRA8)
+        {
+            return mergeRow4Ssse3;
+        }
+    }
+#endif
+    switch (format)
+    {
+        case PixelFormat::BGR8:
+        case PixelFormat::RGB8:   return mergeRowScalar <uint8_t, 3>;
+        case PixelFormat::BGRA8:  return mergeRowScalar <uint8_t, 4>;
+        case PixelFormat::GRAY8:  return mergeRowScalar <uint8_t, 1>;
+        case PixelFormat::GRAY16: return mergeRowScalar <uint16_t, 1>;
+        case PixelFormat::RGB16:  return mergeRowScalar <uint16_t, 3>;
+        case PixelFormat::RGBA16: return mergeRowScalar <uint16_t, 4>;
+        case PixelFormat::RGBF32: return mergeRowScalar <float, 3>;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Merges the planes of one row of a PLANAR buffer into interleaved
+ * pixels, so that code written for interleaved rows can read it.
+ */
+static void mergeBufferRow(MergeRowFunction mergeRow, const PixelBuffer & pixels,
+                           int y, unsigned char * target)
+{
+    const unsigned char * planes[4];
+
+    for (int p = 0; p < pixels.planes(); p++)
+    {
+        planes[p] = pixels.planeData(p, y);
+    }
+    mergeRow(planes, target, pixels.width());
+}
+
+/**
+ * @brief Number of bytes a row of pixels takes in a BMP file, including the
+ * padding that rounds every row up to a multiple of 4 bytes.
+ */
+static size_t bmpRowBytes(int width, int bits_per_pixel)
+{
+    return ((size_t)width * bits_per_pixel + 31) / 32 * 4;
+}
+
+struct RowDecoder;
+
+typedef void (*DecodeRowFunction)(const RowDecoder &, const uchar_t *, unsigned char *, int);
+typedef void (*LookupRowFunction)(const uint32_t *, const uint8_t *, unsigned char *, int);
+
+/**
+ * @brief How the rows of pixels of a file become rows of a PixelBuffer: the
+ * format they decode to, the number of bytes each row takes in the file, and
+ * the kernel that decodes a row along with the state it works from. Rows that
+ * are stored exactly as the format lays them out need no kernel.
+ */
+struct RowDecoder
+{
+    PixelFormat format;
+    size_t row_bytes;
+    DecodeRowFunction decodeRow;
+    uint32_t masks[4];     ///< Red, green, blue and alpha bitfields.
+    int shifts[4];         ///< Position of the lowest bit of each bitfield.
+    int bits[4];           ///< Width of each bitfield.
+    uint8_t shuffle[16];   ///< Byte shuffle for byte-aligned 32-bit bitfields.
+    uint16_t scales[4][3]; ///< Multiplier, addend and shift scaling 16-bit bitfields.
+    uint32_t palette[256]; ///< Color table, as blue, green, red, 0 bytes.
+    LookupRowFunction lookupRow; ///< Expands palette indices into BGR8.
+    int rle_bits;          ///< 8 or 4 for RLE8 or RLE4 pixel arrays, else 0.
+};
+
+/**
+ * @brief Scales a value of a bitfield of any width to 0-255, so that the
+ * largest value of the field becomes 255.
+ */
+static inline uint8_t scaleBitfield(uint32_t value, int bits)
+{
+    if (bits >= 8)
+    {
+        return (uint8_t)(value >> (bits - 8));
+    }
+    const uint32_t max = (1u << bits) - 1;
+    return (uint8_t)((value * 255 + max / 2) / max);
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Finds a multiplier, addend and shift with which (value * multiplier
+ * + addend) >> shift gives exactly what scaleBitfield does for every value of
+ * a bitfield, without the division and within 16 bits, so that eight values
+ * can be scaled at once.
+ *
+ * The multiplier is 255 / max rounded at ever greater precision until an
+ * addend suits every value; one always does by a shift of 7.
+ *
+ * @param width of the bitfield
+ * @param the multiplier, addend and shift to fill in
+ */
+static void findBitfieldScale(int bits, uint16_t scale[3])
+{
+    if (bits >= 8)
+    {
+        scale[0] = 1;
+        scale[1] = 0;
+        scale[2] = bits - 8;
+        return;
+    }
+
+    const int32_t max = (1 << bits) - 1;
+    for (int shift = 0; ; shift++)
+    {
+        const int32_t multiplier = ((255 << shift) + max / 2) / max;
+        int32_t lowest = 0;
+        int32_t highest = 0xFFFF;
+
+        // Each value limits the addend to the range that lands it on its
+        // scaled value.
+        for (int32_t value = 0; value <= max; value++)
+        {
+            const int32_t scaled = scaleBitfield(value, bits);
+            lowest = std::max(lowest, (scaled << shift) - value * multiplier);
+            highest = std::min(highest, ((scaled + 1) << shift) - 1 - value * multiplier);
+        }
+
+        if (lowest <= highest && max * multiplier + lowest <= 0xFFFF)
+        {
+            scale[0] = multiplier;
+            scale[1] = lowest;
+            scale[2] = shift;
+            return;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Decodes a row of 16- or 32-bit pixels whose channels are described
+ * by arbitrary bitfields, into BGR8 or BGRA8.
+ *
+ * Handles every set of masks, where the vector versions need 16-bit pixels or
+ * 32-bit pixels with byte-aligned fields. Pixels without an alpha bitfield become opaque.
+ */
+template <typename T>
+static void decodeBitfieldsScalar(const RowDecoder & decoder, const uchar_t * source,
+                                  unsigned char * target, int count)
+{
+    const int size = decoder.format == PixelFormat::BGRA8 ? 4 : 3;
+
+    for (int col = 0; col < count; col++)
+    {
+        T value;
+        std::memcpy(&value, source + col * sizeof(T), sizeof(T));
+
+        unsigned char * out = target + col * size;
+        out[0] = scaleBitfield((value & decoder.masks[2]) >> decoder.shifts[2], decoder.bits[2]);
+        out[1] = scaleBitfield((value & decoder.masks[1]) >> decoder.shifts[1], decoder.bits[1]);
+        out[2] = scaleBitfield((value & decoder.masks[0]) >> decoder.shifts[0], decoder.bits[0]);
+        if (size == 4)
+        {
+            out[3] = decoder.bits[3] == 0 ? (uint8_t)MAX_RGB
+                    : scaleBitfield((value & decoder.masks[3]) >> decoder.shifts[3],
+                                    decoder.bits[3]);
+        }
+    }
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Decodes a row of 32-bit pixels whose bitfields are each one whole
+ * byte, into BGRA8, four pixels at a time.
+ *
+ * Wherever the masks put the channels, moving them into blue, green, red,
+ * alpha order is a single byte shuffle; its control is worked out from the
+ * masks once per image. A missing alpha channel is zeroed by the shuffle and
+ * then filled in as opaque.
+ */
+__attribute__((target("ssse3")))
+static void decodeByteFields32Ssse3(const RowDecoder & decoder, const uchar_t * source,
+                                    unsigned char * target, int count)
+{
+    const __m128i shuffle = _mm_loadu_si128((const __m128i *)decoder.shuffle);
+    const __m128i opaque = _mm_set1_epi32(decoder.bits[3] == 0 ? 0xFF000000u : 0);
+    int col = 0;
+
+    for (; col + 4 <= count; col += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(source + col * 4));
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), opaque);
+        _mm_storeu_si128((__m128i *)(target + col * 4), pixels);
+    }
+
+    decodeBitfieldsScalar <uint32_t> (decoder, source + col * 4, target + col * 4,
+                                      count - col);
+}
+
+/**
+ * @brief Decodes a row of 16-bit pixels with any bitfields, such as RGB565 or
+ * RGB555, into BGR8 (or BGRA8 when there is an alpha field), sixteen pixels
+ * at a time.
+ *
+ * Each field of eight pixels is masked, shifted down and scaled in 16-bit
+ * lanes with the constants of findBitfieldScale, which round exactly as
+ * scaleBitfield does. The channels then pack to one vector of bytes apiece
+ * and interleave into pixels.
+ */
+template <bool Alpha>
+__attribute__((target("ssse3")))
+static void decodeBitfields16Ssse3(const RowDecoder & decoder, const uchar_t * source,
+                                   unsigned char * target, int count)
+{
+    // Blue, green, red and alpha, the order of the pixels written.
+    static const int order[4] = { 2, 1, 0, 3 };
+    const int N = Alpha ? 4 : 3;
+    __m128i mask[N];
+    __m128i shift[N];
+    __m128i multiplier[N];
+    __m128i addend[N];
+    __m128i scale_shift[N];
+    int col = 0;
+
+    for (int k = 0; k < N; k++)
+    {
+        const int c = order[k];
+        mask[k] = _mm_set1_epi16((short)decoder.masks[c]);
+        shift[k] = _mm_cvtsi32_si128(decoder.shifts[c]);
+        multiplier[k] = _mm_set1_epi16(decoder.scales[c][0]);
+        addend[k] = _mm_set1_epi16(decoder.scales[c][1]);
+        scale_shift[k] = _mm_cvtsi32_si128(decoder.scales[c][2]);
+    }
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i * in = (const __m128i *)(source + col * 2);
+        const __m128i halves[2] = { _mm_loadu_si128(in), _mm_loadu_si128(in + 1) };
+        __m128i channels[N];
+
+        for (int k = 0; k < N; k++)
+        {
+            __m128i scaled[2];
+            for (int h = 0; h < 2; h++)
+            {
+                const __m128i value = _mm_srl_epi16(_mm_and_si128(halves[h], mask[k]),
+                                                    shift[k]);
+                scaled[h] = _mm_srl_epi16(
+                        _mm_add_epi16(_mm_mullo_epi16(value, multiplier[k]), addend[k]),
+                        scale_shift[k]);
+            }
+            channels[k] = _mm_packus_epi16(scaled[0], scaled[1]);
+        }
+
+        __m128i * out = (__m128i *)(target + col * N);
+        if (Alpha)
+        {
+            const __m128i blue_green[2] = { _mm_unpacklo_epi8(channels[0], channels[1]),
+                                            _mm_unpackhi_epi8(channels[0], channels[1]) };
+            const __m128i red_alpha[2] = { _mm_unpacklo_epi8(channels[2], channels[N - 1]),
+                                           _mm_unpackhi_epi8(channels[2], channels[N - 1]) };
+            for (int h = 0; h < 2; h++)
+            {
+                _mm_storeu_si128(out + 2 * h, _mm_unpacklo_epi16(blue_green[h], red_alpha[h]));
+                _mm_storeu_si128(out + 2 * h + 1, _mm_unpackhi_epi16(blue_green[h], red_alpha[h]));
+            }
+        }
+        else
+        {
+            __m128i pixels[3];
+            interleave3(channels, pixels);
+            for (int v = 0; v < 3; v++)
+            {
+                _mm_storeu_si128(out + v, pixels[v]);
+            }
+        }
+    }
+
+    decodeBitfieldsScalar <uint16_t> (decoder, source + col * 2, target + col * N,
+                                      count - col);
+}
+#endif
+
+/**
+ * @brief Swaps the red and blue channels of a row of pixels of N 16-bit
+ * channels. 48- and 64-bit files store blue first, where RGB16 and RGBA16
+ * store red first, so this both decodes and encodes their rows.
+ */
+template <int N>
+static void swapRedBlue16Scalar(const unsigned char * source, unsigned char * target,
+                                int count)
+{
+    for (int col = 0; col < count; col++, source += N * 2, target += N * 2)
+    {
+        uint16_t first;
+        uint16_t middle;
+        uint16_t last;
+        std::memcpy(&first, source, 2);
+        std::memcpy(&middle, source + 2, 2);
+        std::memcpy(&last, source + 4, 2);
+        std::memcpy(target, &last, 2);
+        std::memcpy(target + 2, &middle, 2);
+        std::memcpy(target + 4, &first, 2);
+        if (N == 4)
+        {
+            std::memcpy(target + 6, source + 6, 2);
+        }
+    }
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Swaps the red and blue channels of a row of 16-bit pixels, two
+ * pixels per shuffle. Six-byte pixels leave four bytes of each vector over,
+ * which are copied as they are and swapped by the next step.
+ */
+template <int N>
+__attribute__((target("ssse3")))
+static void swapRedBlue16Ssse3(const unsigned char * source, unsigned char * target,
+                               int count)
+{
+    const __m128i order = N == 4
+            ? _mm_setr_epi8(4, 5, 2, 3, 0, 1, 6, 7, 12, 13, 10, 11, 8, 9, 14, 15)
+            : _mm_setr_epi8(4, 5, 2, 3, 0, 1, 10, 11, 8, 9, 6, 7, 12, 13, 14, 15);
+    int col = 0;
+
+    // Each step reads and writes 16 bytes, which reach into a third pixel
+    // when pixels are six bytes, so stop while they still fit.
+    for (; col + (N == 4 ? 2 : 3) <= count; col += 2)
+    {
+        const __m128i pixels = _mm_loadu_si128((const __m128i *)(source + col * N * 2));
+        _mm_storeu_si128((__m128i *)(target + col * N * 2),
+                         _mm_shuffle_epi8(pixels, order));
+    }
+
+    swapRedBlue16Scalar <N> (source + col * N * 2, target + col * N * 2, count - col);
+}
+#endif
+
+typedef void (*SwapRowFunction)(const unsigned char *, unsigned char *, int);
+
+/**
+ * @brief Picks the fastest red and blue swap the running CPU supports.
+ */
+template <int N>
+static SwapRowFunction selectSwapRedBlue16()
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return swapRedBlue16Ssse3 <N>;
+    }
+#endif
+    return swapRedBlue16Scalar <N>;
+}
+
+/**
+ * @brief Decodes a row of a 48-bit (N = 3) or 64-bit (N = 4) file into RGB16
+ * or RGBA16.
+ */
+template <int N>
+static void decodeWideRow(const RowDecoder &, const uchar_t * source,
+                          unsigned char * target, int count)
+{
+    static const SwapRowFunction swapRow = selectSwapRedBlue16 <N> ();
+    swapRow(source, target, count);
+}
+
+/**
+ * @brief Works out from a set of bitfield masks where each channel lies, and
+ * picks the fastest kernel that can decode pixels laid out that way.
+ *
+ * @param the red, green, blue and alpha masks; alpha may be 0
+ * @param bits per pixel of the file, 16 or 32
+ * @param the decoder to fill in
+ * @return whether the masks describe channels that can be decoded
+ */
+static bool selectBitfieldsDecoder(const uint32_t masks[4], int bits_per_pixel,
+                                   RowDecoder & decoder)
+{
+    bool byte_fields = bits_per_pixel == 32;
+
+    for (int c = 0; c < 4; c++)
+    {
+        uint32_t mask = masks[c];
+        decoder.masks[c] = mask;
+        decoder.shifts[c] = 0;
+        decoder.bits[c] = 0;
+
+        if (mask == 0)
+        {
+            // Only alpha may be left out.
+            if (c < 3)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        while ((mask & 1) == 0)
+        {
+            mask >>= 1;
+            decoder.shifts[c]++;
+        }
+        while ((mask & 1) != 0)
+        {
+            mask >>= 1;
+            decoder.bits[c]++;
+        }
+
+        // Each mask has to be one run of bits.
+        if (mask != 0)
+        {
+            return false;
+        }
+        byte_fields = byte_fields && decoder.bits[c] == 8 && decoder.shifts[c] % 8 == 0;
+    }
+
+    decoder.format = bits_per_pixel == 32 || masks[3] != 0 ? PixelFormat::BGRA8
+                                                           : PixelFormat::BGR8;
+    decoder.decodeRow = bits_per_pixel == 32 ? decodeBitfieldsScalar <uint32_t>
+                                             : decodeBitfieldsScalar <uint16_t>;
+
+    // The masks of V4 and V5 headers written by most encoders put blue,
+    // green, red and alpha bytes in the order of BGRA8, so those rows are
+    // read as they are.
+    if (bits_per_pixel == 32 && masks[0] == 0x00FF0000 && masks[1] == 0x0000FF00
+            && masks[2] == 0x000000FF && masks[3] == 0xFF000000)
+    {
+        decoder.decodeRow = NULL;
+        return true;
+    }
+
+#ifdef BITMAP_SIMD_X86
+    if (byte_fields && __builtin_cpu_supports("ssse3"))
+    {
+        // Blue, green, red and alpha of each pixel come from the bytes the
+        // masks point at; a missing alpha byte is zeroed (-1 in the control).
+        static const int order[4] = { 2, 1, 0, 3 };
+
+        for (int i = 0; i < 16; i++)
+        {
+            const int c = order[i % 4];
+            decoder.shuffle[i] = decoder.bits[c] == 0
+                    ? 0x80 : (uint8_t)(i / 4 * 4 + decoder.shifts[c] / 8);
+        }
+        decoder.decodeRow = decodeByteFields32Ssse3;
+    }
+    if (bits_per_pixel == 16 && __builtin_cpu_supports("ssse3"))
+    {
+        for (int c = 0; c < (masks[3] != 0 ? 4 : 3); c++)
+        {
+            findBitfieldScale(decoder.bits[c], decoder.scales[c]);
+        }
+        decoder.decodeRow = masks[3] != 0 ? decodeBitfields16Ssse3 <true>
+                                          : decodeBitfields16Ssse3 <false>;
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Looks up a row of palette indices in a color table, writing BGR8.
+ */
+static void lookupRowScalar(const uint32_t * palette, const uint8_t * indices,
+                            unsigned char * target, int count)
+{
+    for (int col = 0; col < count; col++)
+    {
+        std::memcpy(target + col * 3, &palette[indices[col]], 3);
+    }
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Looks up a row of palette indices in a color table, eight at a
+ * time.
+ *
+ * The eight indices are widened to ints and the entries gathered from the
+ * table in one instruction. A shuffle then drops the unused fourth byte of
+ * every entry, leaving twelve bytes of BGR data at the bottom of each half,
+ * and the halves are stored so that the second overwrites the four spare
+ * bytes of the first.
+ */
+__attribute__((target("avx2")))
+static void lookupRowAvx2(const uint32_t * palette, const uint8_t * indices,
+                          unsigned char * target, int count)
+{
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                          -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                          -1, -1, -1, -1);
+    int col = 0;
+
+    // Each group writes 28 bytes but keeps 24, so stop while the spare four
+    // bytes still fall inside the row.
+    for (; col + 10 <= count; col += 8)
+    {
+        const __m256i index = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)(indices + col)));
+        const __m256i bgr = _mm256_shuffle_epi8(
+                _mm256_i32gather_epi32((const int *)palette, index, 4), pack);
+
+        _mm_storeu_si128((__m128i *)(target + col * 3), _mm256_castsi256_si128(bgr));
+        _mm_storeu_si128((__m128i *)(target + col * 3 + 12),
+                         _mm256_extracti128_si256(bgr, 1));
+    }
+
+    lookupRowScalar(palette, indices + col, target + col * 3, count - col);
+}
+#endif
+
+/**
+ * @brief Picks the fastest palette lookup the running CPU supports.
+ */
+static LookupRowFunction selectLookupRow()
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return lookupRowAvx2;
+    }
+#endif
+    return lookupRowScalar;
+}
+
+/**
+ * @brief Decodes a row of 1-, 4- or 8-bit palette indices into BGR8.
+ *
+ * 8-bit indices are looked up where they lie. Smaller ones are first
+ * unpacked, leftmost pixel in the highest bits of each byte, into a byte
+ * each, a few hundred at a time, and then looked up the same way.
+ */
+template <int Bits>
+static void decodeIndexedRow(const RowDecoder & decoder, const uchar_t * source,
+                             unsigned char * target, int count)
+{
+    if (Bits == 8)
+    {
+        decoder.lookupRow(decoder.palette, source, target, count);
+        return;
+    }
+
+    const int per_byte = 8 / Bits;
+    const uint8_t mask = (1 << Bits) - 1;
+    uint8_t indices[256];
+
+    for (int col = 0; col < count; col += 256)
+    {
+        const int length = std::min(256, count - col);
+
+        for (int i = 0; i < length; i++)
+        {
+            const int pixel = col + i;
+            const int shift = 8 - Bits * (pixel % per_byte + 1);
+            indices[i] = (source[pixel / per_byte] >> shift) & mask;
+        }
+        decoder.lookupRow(decoder.palette, indices, target + col * 3, length);
+    }
+}
+
+/**
+ * @brief Reads the color table of an indexed file, which follows the DIB
+ * header, into a decoder. Entries missing from a short table are black.
+ *
+ * @param the stream to read the table from
+ * @param name of the file, used to report errors
+ * @param the DIB information of the file
+ * @param the decoder to fill in
+ * @return whether the whole table could be read
+ */
+static bool readColorTable(std::istream & file, const std::string & filename,
+                           const bmpfile_dib_info & dib_info, RowDecoder & decoder)
+{
+    const uint32_t most = 1u << dib_info.bits_per_pixel;
+    const uint32_t entries = dib_info.num_colors == 0 || dib_info.num_colors > most
+            ? most : dib_info.num_colors;
+
+    // Entries of a core header's table are blue, green, red triplets.
+    const size_t entry_bytes = dib_info.header_size == BMP_CORE_HEADER_SIZE ? 3 : 4;
+    uchar_t table[256 * 4];
+
+    std::memset(decoder.palette, 0, sizeof(decoder.palette));
+    file.seekg(sizeof(bmpfile_magic) + sizeof(bmpfile_header) + dib_info.header_size);
+
+    if (!file.read((char*)(table), entries * entry_bytes))
+    {
+        std::cout << filename << " is truncated; it ends before "
+                  << "its color table.\n";
+        return false;
+    }
+
+    // The fourth byte of a full entry is reserved, and is not always 0.
+    for (uint32_t i = 0; i < entries; i++)
+    {
+        const uchar_t * entry = table + i * entry_bytes;
+        decoder.palette[i] = entry[0] | entry[1] << 8 | entry[2] << 16;
+    }
+    return true;
+}
+
+/**
+ * @brief Decodes a whole RLE8 or RLE4 pixel array straight into the rows of
+ * an image of BGR8 pixels.
+ *
+ * Runs are filled with their color, and literal stretches of indices are
+ * expanded with the same lookup kernel as uncompressed indexed rows. Pixels
+ * that delta escapes skip over keep the black the image started with, and
+ * anything that falls outside the image is dropped.
+ *
+ * @param the decoder, with the color table of the file
+ * @param the compressed pixel array
+ * @param number of bytes of it
+ * @param the image to fill, already sized
+ * @param whether the first row of the file is the bottom row of the image
+ * @return whether the data covered every row or ended the bitmap, rather
+ *         than running out
+ */
+static bool decodeRle(const RowDecoder & decoder, const uchar_t * data, size_t size,
+                      PixelBuffer & pixels, bool flip)
+{
+    const int width = pixels.width();
+    const int height = pixels.height();
+    const bool rle4 = decoder.rle_bits == 4;
+    uint8_t indices[256];
+    int x = 0;
+    int y = 0;
+    size_t i = 0;
+
+    while (y < height)
+    {
+        if (i + 2 > size)
+        {
+            return false;
+        }
+
+        const int count = data[i];
+        const int value = data[i + 1];
+        i += 2;
+
+        unsigned char * row = pixels.rowData(flip ? height - 1 - y : y);
+        const int visible = std::max(0, std::min(count == 0 ? value : count, width - x));
+
+        if (count > 0)
+        {
+            // A run of one index, or of two alternating ones for RLE4.
+            const uint32_t first = decoder.palette[rle4 ? value >> 4 : value];
+            const uint32_t second = decoder.palette[rle4 ? value & 0xF : value];
+
+            for (int n = 0; n < visible; n++)
+            {
+                std::memcpy(row + (x + n) * 3, n % 2 == 0 ? &first : &second, 3);
+            }
+            x += count;
+        }
+        else if (value == 0)
+        {
+            // End of the row.
+            x = 0;
+            y++;
+        }
+        else if (value == 1)
+        {
+            // End of the bitmap.
+            return true;
+        }
+        else if (value == 2)
+        {
+            // Delta: move right and up (or down, for top-down files).
+            if (i + 2 > size)
+            {
+                return false;
+            }
+            x += data[i];
+            y += data[i + 1];
+            i += 2;
+        }
+        else
+        {
+            // A literal stretch of indices, padded to a whole number of
+            // 16-bit words.
+            const size_t bytes = rle4 ? (value + 1) / 2 : value;
+            if (i + bytes > size)
+            {
+                return false;
+            }
+
+            const uint8_t * literal = data + i;
+            if (rle4)
+            {
+                for (int n = 0; n < visible; n++)
+                {
+                    indices[n] = n % 2 == 0 ? literal[n / 2] >> 4 : literal[n / 2] & 0xF;
+                }
+                literal = indices;
+            }
+            decoder.lookupRow(decoder.palette, literal, row + x * 3, visible);
+
+            x += value;
+            i += (bytes + 1) & ~(size_t)1;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Compresses a row of 8-bit indices with RLE8 onto the end of a
+ * buffer, without the escape that ends the row.
+ *
+ * Repeats of three or more become runs. Everything else is gathered into
+ * literal stretches, except stretches of one or two indices, which are
+ * shorter written as runs of one.
+ */
+static void encodeRle8Row(const uint8_t * indices, int width, std::vector <uchar_t> & target)
+{
+    int col = 0;
+
+    while (col < width)
+    {
+        int run = 1;
+        while (col + run < width && run < 255 && indices[col + run] == indices[col])
+        {
+            run++;
+        }
+
+        if (run >= 3)
+        {
+            target.push_back(run);
+            target.push_back(indices[col]);
+            col += run;
+            continue;
+        }
+
+        // Extend the literal stretch up to the next run of three.
+        int length = 0;
+        while (col + length < width && length < 255
+                && !(col + length + 2 < width
+                     && indices[col + length] == indices[col + length + 1]
+                     && indices[col + length] == indices[col + length + 2]))
+        {
+            length++;
+        }
+
+        if (length < 3)
+        {
+            for (int n = 0; n < length; n++)
+            {
+                target.push_back(1);
+                target.push_back(indices[col + n]);
+            }
+        }
+        else
+        {
+            target.push_back(0);
+            target.push_back(length);
+            target.insert(target.end(), indices + col, indices + col + length);
+            if (length % 2 != 0)
+            {
+                target.push_back(0);
+            }
+        }
+        col += length;
+    }
+}
+
+typedef void (*Pack16RowFunction)(const unsigned char *, uchar_t *, int, int, const uint16_t *);
+
+// What is added to each channel, scaled by the largest value of its field,
+// before dividing by 255: a half, to round, or for dithering the thresholds
+// of a 4x4 Bayer matrix, (2 * b + 1) * 255 / 32 for each entry b, row by row.
+static const uint16_t ROUND_OFFSETS[4] = { 127, 127, 127, 127 };
+static const uint16_t DITHER_OFFSETS[4][4] = {
+    { 7, 135, 39, 167 },
+    { 199, 71, 231, 103 },
+    { 55, 183, 23, 151 },
+    { 247, 119, 215, 87 }
+};
+
+/**
+ * @brief Packs a row of BGR8 pixels into 16-bit RGB555 or RGB565 pixels.
+ *
+ * Every channel becomes (value * max + offset) / 255, where max is the
+ * largest value of its field and the offset of each column comes from the
+ * four given.
+ *
+ * @param the BGR8 pixels
+ * @param where to write the 16-bit pixels
+ * @param number of pixels
+ * @param width of the green field, 5 or 6; red and blue are 5 bits wide
+ * @param the offsets of every four columns
+ */
+static void packRgb16RowScalar(const unsigned char * source, uchar_t * target, int count,
+                               int green_bits, const uint16_t * offsets)
+{
+    const uint32_t green_max = (1u << green_bits) - 1;
+
+    for (int col = 0; col < count; col++)
+    {
+        const unsigned char * pixel = source + col * 3;
+        const uint32_t offset = offsets[col & 3];
+        const uint16_t value = (uint16_t)(((pixel[2] * 31 + offset) / 255) << (5 + green_bits)
+                | ((pixel[1] * green_max + offset) / 255) << 5
+                | (pixel[0] * 31 + offset) / 255);
+
+        std::memcpy(target + col * 2, &value, sizeof(value));
+    }
+}
+
+#ifdef BITMAP_SIMD_X86
+/**
+ * @brief Packs a row of BGR8 pixels into 16-bit RGB555 or RGB565 pixels,
+ * sixteen at a time.
+ *
+ * The pixels are split into channels with deinterleave3 and each channel is
+ * widened to 16-bit lanes, scaled and offset as packRgb16RowScalar does. The
+ * division by 255 is (x + 1 + (x >> 8)) >> 8, which is exact for the sums
+ * involved, so the results match the scalar version bit for bit. Sixteen is
+ * a multiple of four, so every vector sees the offsets in the same order.
+ */
+__attribute__((target("ssse3")))
+static void packRgb16RowSsse3(const unsigned char * source, uchar_t * target, int count,
+                              int green_bits, const uint16_t * offsets)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i offset = _mm_setr_epi16(offsets[0], offsets[1], offsets[2], offsets[3],
+                                          offsets[0], offsets[1], offsets[2], offsets[3]);
+    const __m128i max[3] = { _mm_set1_epi16(31), _mm_set1_epi16((1 << green_bits) - 1),
+                             _mm_set1_epi16(31) };
+    const __m128i shift[3] = { _mm_cvtsi32_si128(0), _mm_cvtsi32_si128(5),
+                               _mm_cvtsi32_si128(5 + green_bits) };
+    int col = 0;
+
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m128i * in = (const __m128i *)(source + col * 3);
+        const __m128i pixels[3] = { _mm_loadu_si128(in), _mm_loadu_si128(in + 1),
+                                    _mm_loadu_si128(in + 2) };
+        __m128i channels[3];
+        __m128i packed[2] = { zero, zero };
+
+        deinterleave3(pixels, channels);
+        for (int c = 0; c < 3; c++)
+        {
+            const __m128i halves[2] = { _mm_unpacklo_epi8(channels[c], zero),
+                                        _mm_unpackhi_epi8(channels[c], zero) };
+            for (int h = 0; h < 2; h++)
+            {
+                const __m128i sum = _mm_add_epi16(_mm_mullo_epi16(halves[h], max[c]), offset);
+                const __m128i field = _mm_srli_epi16(
+                        _mm_add_epi16(_mm_add_epi16(sum, one), _mm_srli_epi16(sum, 8)), 8);
+                packed[h] = _mm_or_si128(packed[h], _mm_sll_epi16(field, shift[c]));
+            }
+        }
+
+        _mm_storeu_si128((__m128i *)(target + col * 2), packed[0]);
+        _mm_storeu_si128((__m128i *)(target + col * 2 + 16), packed[1]);
+    }
+
+    packRgb16RowScalar(source + col * 3, target + col * 2, count - col, green_bits, offsets);
+}
+#endif
+
+/**
+ * @brief Picks the fastest 16-bit packing the running CPU supports.
+ */
+static Pack16RowFunction selectPackRgb16Row()
+{
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return packRgb16RowSsse3;
+    }
+#endif
+    return packRgb16RowScalar;
+}
+
+/**
+ * @brief Works out how to decode the pixels of a file from its headers,
+ * reading the color table that follows them when the file has one.
+ *
+ * @param the stream to read the color table from
+ * @param name of the file, used to report errors
+ * @param the DIB information of the file
+ * @param the color masks and other fields of larger headers, as read by
+ *        readHeaders
+ * @param the decoder to fill in
+ * @return whether Bitmap can decode the pixels of the file
+ */
+static bool selectRowDecoder(std::istream & file, const std::string & filename,
+                             const bmpfile_dib_info & dib_info,
+                             const bmpfile_v5_info & extra, RowDecoder & decoder)
+{
+    const int bits_per_pixel = dib_info.bits_per_pixel;
+
+    decoder.format = PixelFormat::BGR8;
+    decoder.row_bytes = bmpRowBytes(dib_info.width, bits_per_pixel);
+    decoder.decodeRow = NULL;
+    decoder.rle_bits = 0;
+
+    if (dib_info.compression == BMP_BI_RGB && bits_per_pixel == 24)
+    {
+        return true;
+    }
+    if (dib_info.compression == BMP_BI_RGB && bits_per_pixel == 32)
+    {
+        // Already blue, green, red and alpha bytes, exactly as BGRA8.
+        decoder.format = PixelFormat::BGRA8;
+        return true;
+    }
+    if (dib_info.compression == BMP_BI_RGB && bits_per_pixel == 16)
+    {
+        // Uncompressed 16-bit files are RGB555, with the top bit unused.
+        const uint32_t masks[4] = { 0x7C00, 0x03E0, 0x001F, 0 };
+        return selectBitfieldsDecoder(masks, bits_per_pixel, decoder);
+    }
+    if (dib_info.compression == BMP_BI_RGB && (bits_per_pixel == 48 || bits_per_pixel == 64))
+    {
+        // Blue, green, red (and alpha) as full-range 16-bit values.
+        decoder.format = bits_per_pixel == 48 ? PixelFormat::RGB16 : PixelFormat::RGBA16;
+        decoder.decodeRow = bits_per_pixel == 48 ? decodeWideRow <3> : decodeWideRow <4>;
+        return true;
+    }
+    if (dib_info.compression == BMP_BI_RGB
+            && (bits_per_pixel == 1 || bits_per_pixel == 4 || bits_per_pixel == 8))
+    {
+        decoder.lookupRow = selectLookupRow();
+        decoder.decodeRow = bits_per_pixel == 1 ? decodeIndexedRow <1>
+                : bits_per_pixel == 4 ? decodeIndexedRow <4> : decodeIndexedRow <8>;
+        return readColorTable(file, filename, dib_info, decoder);
+    }
+    if ((dib_info.compression == BMP_BI_RLE8 && bits_per_pixel == 8)
+            || (dib_info.compression == BMP_BI_RLE4 && bits_per_pixel == 4))
+    {
+        // Compressed rows have no fixed size; see decodeRle.
+        decoder.lookupRow = selectLookupRow();
+        decoder.rle_bits = bits_per_pixel;
+        return readColorTable(file, filename, dib_info, decoder);
+    }
+    if ((dib_info.compression == BMP_BI_BITFIELDS || dib_info.compression == BMP_BI_ALPHABITFIELDS)
+            && (bits_per_pixel == 16 || bits_per_pixel == 32))
+    {
+        // readHeaders has found the masks, wherever the header keeps them.
+        const uint32_t masks[4] = { extra.red_mask, extra.green_mask,
+                                    extra.blue_mask, extra.alpha_mask };
+
+        if (!selectBitfieldsDecoder(masks, bits_per_pixel, decoder))
+        {
+            std::cout << filename << " has color masks that are not "
+                      << "contiguous runs of bits.\n";
+            return false;
+        }
+        return true;
+    }
+
+    if (dib_info.compression != BMP_BI_RGB && dib_info.compression != BMP_BI_BITFIELDS
+            && dib_info.compression != BMP_BI_RLE8 && dib_info.compression != BMP_BI_RLE4)
+    {
+        std::cout<<filename<<" is compressed. "
+                 <<"Bitmap only supports uncompressed and RLE images.\n";
+    }
+    else
+    {
+        std::cout<<filename<<" uses "<<dib_info.bits_per_pixel
+                 <<"bits per pixel (bit depth). Bitmap only supports 1, 4, 8, 16, 24, 32, "
+                 <<"48 and 64bit.\n";
+    }
+    return false;
+}
+
+/**
+ * @brief Makes every pixel of a BGRA8 image opaque if none of them has any
+ * alpha. 32-bit files without bitfields were long written with the fourth
+ * byte of every pixel left 0, meaning unused rather than fully transparent.
+ */
+static void makeOpaqueIfNoAlpha(PixelBuffer & pixels)
+{
+    const PixelBuffer & source = pixels;
+
+    for (int row = 0; row < source.height(); row++)
+    {
+        const unsigned char * in = source.rowData(row);
+        for (int col = 0; col < source.width(); col++)
+        {
+            if (in[col * 4 + 3] != 0)
+            {
+                return;
+            }
+        }
+    }
+
+    for (int row = 0; row < pixels.height(); row++)
+    {
+        unsigned char * out = pixels.rowData(row);
+        for (int col = 0; col < pixels.width(); col++)
+        {
+            out[col * 4 + 3] = (uint8_t)MAX_RGB;
+        }
+    }
+}
+
+/**
+ * @brief Sizes an image for the pixels of a file, turning down RLE images
+ * larger than BMP_MAX_RLE_PIXELS and reporting rather than throwing when the
+ * memory cannot be had.
+ *
+ * @param the image to size
+ * @param width and height of the image
+ * @param the decoder picked for the file
+ * @param whether the first row of the file is the bottom row of the image
+ * @param name of the file, used to report errors
+ * @return whether the image now has room for every pixel
+ */
+static bool allocatePixels(PixelBuffer & pixels, int width, int height,
+                           const RowDecoder & decoder, bool flip, const std::string & filename)
+{
+    if (decoder.rle_bits != 0 && (uint64_t)width * height > BMP_MAX_RLE_PIXELS)
+    {
+        std::cout << filename << " claims to be " << width << " by " << height
+                  << " pixels, more than Bitmap reads from an RLE image.\n";
+        return false;
+    }
+
+    try
+    {
+        // Keep the row order of the file in memory, so that the rows are
+        // filled front to back whichever way up the file is stored.
+        pixels.resize(width, height, decoder.format, flip);
+    }
+    catch (const std::bad_alloc &)
+    {
+        pixels.clear();
+        std::cout << filename << " is " << width << " by " << height
+                  << " pixels, which there is not the memory to hold.\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Serializes the magic bytes, header and DIB information of an
+ * uncompressed image into memory.
+ *
+ * 16-, 24-, 48-, 64-bit and indexed images get a plain BITMAPINFOHEADER,
+ * indexed images followed by their color table and 16-bit images by their
+ * BI_BITFIELDS masks if they are given any. 32-bit images get a
+ * BITMAPV4HEADER with BI_BITFIELDS masks for blue, green, red and alpha
+ * bytes, the one form of 32-bit file in which readers reliably keep alpha.
+ *
+ * @param where to write the headers
+ * @param width of the image in pixels
+ * @param height of the image; positive for rows stored bottom-up
+ * @param bits per pixel: 1, 4 or 8 with a color table, 16, 24, 32, 48 or 64
+ * @param the color table, as blue, green, red, 0 bytes per entry
+ * @param number of entries in the color table
+ * @param size of the pixel array if it is compressed with RLE8, otherwise 0
+ * @param red, green and blue masks of 16-bit pixels other than RGB555
+ * @return the number of bytes written, which is also the offset of the pixels
+ */
+static size_t packHeaders(uchar_t * target, int width, int height, int bits_per_pixel = 24,
+                          const uint32_t * palette = NULL, int colors = 0,
+                          size_t rle8_bytes = 0, const uint32_t * masks = NULL)
+{
+    const uint32_t image_bytes = rle8_bytes != 0 ? rle8_bytes
+            : bmpRowBytes(width, bits_per_pixel) * std::abs(height);
+    const uint32_t dib_size = bits_per_pixel == 32
+            ? BMP_V4_HEADER_SIZE : sizeof(bmpfile_dib_info);
+
+    bmpfile_magic magic;
+    magic.magic[0] = 'B';
+    magic.magic[1] = 'M';
+
+    bmpfile_header header = { 0 };
+    header.bmp_offset = sizeof(bmpfile_magic) + sizeof(bmpfile_header) + dib_size
+            + colors * sizeof(uint32_t) + (masks != NULL ? 3 * sizeof(uint32_t) : 0);
+    header.file_size = header.bmp_offset + image_bytes;
+
+    bmpfile_dib_info dib_info = { 0 };
+    dib_info.header_size = dib_size;
+    dib_info.width = width;
+    dib_info.height = height;
+    dib_info.num_planes = 1;
+    dib_info.bits_per_pixel = bits_per_pixel;
+    dib_info.compression = bits_per_pixel == 32 || masks != NULL ? BMP_BI_BITFIELDS
+            : rle8_bytes != 0 ? BMP_BI_RLE8 : BMP_BI_RGB;
+    dib_info.bmp_byte_size = image_bytes;
+    dib_info.hres = 2835;
+    dib_info.vres = 2835;
+    dib_info.num_colors = colors;
+    dib_info.num_important_colors = 0;
+
+    std::memcpy(target, &magic, sizeof(magic));
+    std::memcpy(target + sizeof(magic), &header, sizeof(header));
+    std::memcpy(target + sizeof(magic) + sizeof(header), &dib_info, sizeof(dib_info));
+
+    if (colors > 0)
+    {
+        std::memcpy(target + sizeof(magic) + sizeof(header) + sizeof(dib_info),
+                    palette, colors * sizeof(uint32_t));
+    }
+    if (masks != NULL)
+    {
+        std::memcpy(target + sizeof(magic) + sizeof(header) + sizeof(dib_info),
+                    masks, 3 * sizeof(uint32_t));
+    }
+
+    if (bits_per_pixel == 32)
+    {
+        // Red, green, blue and alpha masks, then the sRGB color space; the
+        // endpoints and gammas that follow are unused for sRGB.
+        const uint32_t extra[5] = { 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000,
+                                    0x73524742 };
+        uchar_t * rest = target + sizeof(magic) + sizeof(header) + sizeof(dib_info);
+
+        std::memset(rest, 0, dib_size - sizeof(dib_info));
+        std::memcpy(rest, extra, sizeof(extra));
+    }
+
+    return header.bmp_offset;
+}
+
+/**
+ * @brief The distinct colors of an image that has few enough of them to be
+ * saved as indices into a color table, and the index of each color.
+ *
+ * Grays, the colors of scans, are looked up directly by their level. Other
+ * colors are kept in a small open-addressed hash table keyed by their blue,
+ * green, red bytes; neighbouring pixels are very often the same color, so
+ * the last of them looked up is remembered and checked first.
+ */
+class ColorTable
+{
+  private:
+    static const int SLOTS = 1024;
+
+    uint32_t keys[SLOTS];
+    int16_t values[SLOTS];
+    int16_t gray_values[256];
+    uint32_t last_key;
+    int last_value;
+    int count;
+
+    static int slot(uint32_t key) { return (key * 2654435761u) >> 22; }
+
+    int find(uint32_t key) const
+    {
+        int i = slot(key);
+        while (values[i] >= 0 && keys[i] != key)
+        {
+            i = (i + 1) & (SLOTS - 1);
+        }
+        return i;
+    }
+
+    static bool isGray(const unsigned char * pixel)
+    {
+        return pixel[0] == pixel[1] && pixel[1] == pixel[2];
+    }
+
+    // Index of a color known to be in the table.
+    int index(const unsigned char * pixel)
+    {
+        if (isGray(pixel))
+        {
+            return gray_values[pixel[0]];
+        }
+
+        uint32_t key = 0;
+        std::memcpy(&key, pixel, 3);
+        if (key != last_key)
+        {
+            last_key = key;
+            last_value = values[find(key)];
+        }
+        return last_value;
+    }
+
+  public:
+    uint32_t colors[256];  ///< The colors, as blue, green, red, 0 bytes.
+
+    ColorTable() : last_key(0xFFFFFFFF), last_value(-1), count(0)
+    {
+        std::memset(values, -1, sizeof(values));
+        std::memset(gray_values, -1, sizeof(gray_values));
+    }
+
+    int size() const { return count; }
+
+    /**
+     * Adds the colors of a row of BGR8 pixels.
+     *
+     * @return false as soon as there are more than 256 colors
+     */
+    bool addRow(const unsigned char * row, int width)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            const unsigned char * pixel = row + col * 3;
+            uint32_t key = 0;
+            std::memcpy(&key, pixel, 3);
+
+            if (isGray(pixel) ? gray_values[pixel[0]] >= 0 : key == last_key)
+            {
+                continue;
+            }
+
+            const int i = find(key);
+            if (values[i] < 0)
+            {
+                if (count == 256)
+                {
+                    return false;
+                }
+                keys[i] = key;
+                values[i] = count;
+                colors[count++] = key;
+                if (isGray(pixel))
+                {
+                    gray_values[pixel[0]] = 0;
+                }
+            }
+            last_key = key;
+        }
+        return true;
+    }
+
+    // Puts the colors in increasing order, so that gray ramps stay ramps.
+    void sort()
+    {
+        std::sort(colors, colors + count);
+        for (int c = 0; c < count; c++)
+        {
+            values[find(colors[c])] = c;
+            if (colors[c] == (colors[c] & 0xFF) * 0x010101u)
+            {
+                gray_values[colors[c] & 0xFF] = c;
+            }
+        }
+        last_key = 0xFFFFFFFF;
+    }
+
+    // Smallest bit depth with room for an index of every color.
+    int bitsPerPixel() const { return count <= 2 ? 1 : count <= 16 ? 4 : 8; }
+
+    /**
+     * Replaces each pixel of a row of BGR8 pixels, all of whose colors are
+     * in the table, by its index, packed at the given bit depth with the
+     * leftmost pixel in the highest bits of each byte.
+     */
+    void indexRow(const unsigned char * row, unsigned char * target, int width,
+                  int bits_per_pixel)
+    {
+        if (bits_per_pixel == 8)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                target[col] = index(row + col * 3);
+            }
+            return;
+        }
+
+        const int per_byte = 8 / bits_per_pixel;
+
+        std::memset(target, 0, (width + per_byte - 1) / per_byte);
+        for (int col = 0; col < width; col++)
+        {
+            const int shift = 8 - bits_per_pixel * (col % per_byte + 1);
+            target[col / per_byte] |= index(row + col * 3) << shift;
+        }
+    }
+};
+
+/**
+ * @brief Presents the rows of a buffer in a given format, whatever format and
+ * layout the buffer stores them in. Planar rows are merged and rows in other
+ * formats converted, into scratch space that each row reuses; rows already
+ * stored that way are handed out where they lie.
+ */
+class RowConverter
+{
+  private:
+    const PixelBuffer & pixels;
+    ConvertRowFunction convertRow;
+    MergeRowFunction mergeRow;
+    std::vector <unsigned char> merged;
+    std::vector <unsigned char> converted;
+
+  public:
+    RowConverter(const PixelBuffer & source, PixelFormat format)
+        : pixels(source),
+          convertRow(source.format() == format ? NULL
+                     : selectConvertRow(source.format(), format)),
+          mergeRow(source.layout() == PixelLayout::PLANAR ? selectMergeRow(source.format())
+                                                          : NULL),
+          merged(mergeRow != NULL ? source.width() * pixelFormatSize(source.format()) : 0),
+          converted(convertRow != NULL ? source.width() * pixelFormatSize(format) : 0)
+    {
+    }
+
+    // Pointer to the first byte of a row (0 is the top) in the format.
+    const unsigned char * row(int y)
+    {
+        const unsigned char * data = pixels.rowData(y);
+        if (mergeRow != NULL)
+        {
+            mergeBufferRow(mergeRow, pixels, y, &merged[0]);
+            data = &merged[0];
+        }
+        if (convertRow != NULL)
+        {
+            convertRow(data, &converted[0], pixels.width());
+            data = &converted[0];
+        }
+        return data;
+    }
+};
+
+/**
+ * @brief Reads the magic bytes, header and DIB information at the start of a
+ * file, leaving the stream just after them.
+ *
+ * The size at the start of the DIB header decides how the rest of it is
+ * read: a BITMAPCOREHEADER is widened into the fields of a
+ * BITMAPINFOHEADER, and the masks, color space and ICC profile of larger
+ * headers are read into the extra fields when they are asked for. So are the
+ * color masks that follow a BITMAPINFOHEADER with BI_BITFIELDS, so that
+ * nothing after this needs to know which header the file has. The OS/2 2.x
+ * header has no such fields, and its compression values beyond RLE4 are not
+ * those of Windows, so files that use them are rejected.
+ *
+ * @param the stream to read from, positioned at the start of the file
+ * @param name of the file, used to report errors
+ * @param the file header to fill in
+ * @param the DIB information to fill in
+ * @param the fields of larger headers to fill in, zero for those the header
+ *        does not have, or NULL if they are not needed
+ * @param where to report errors
+ * @return whether the file begins with complete BMP headers
+ */
+static bool readHeaders(std::istream & file, const std::string & filename,
+                        bmpfile_header & header, bmpfile_dib_info & dib_info,
+                        bmpfile_v5_info * extra = NULL, std::ostream & log = std::cout)
+{
+    bmpfile_magic magic;
+
+    std::memset(&dib_info, 0, sizeof(dib_info));
+
+    if (!file.read((char*)(&magic), sizeof(magic))
+            || magic.magic[0] != 'B' || magic.magic[1] != 'M'
+            || !file.read((char*)(&header), sizeof(header))
+            || !file.read((char*)(&dib_info.header_size), sizeof(dib_info.header_size)))
+    {
+        log << filename << " is not in proper BMP format; it does "
+                  << "not begin with the magic bytes!\n";
+        return false;
+    }
+
+    bool complete = true;
+    const uint32_t header_size = dib_info.header_size;
+
+    if (header_size == BMP_CORE_HEADER_SIZE)
+    {
+        // Core headers have no compression or color counts, and are always
+        // stored bottom-up.
+        bmpfile_core_info core;
+        complete = (bool)file.read((char*)(&core), sizeof(core));
+        dib_info.width = core.width;
+        dib_info.height = core.height;
+        dib_info.num_planes = core.num_planes;
+        dib_info.bits_per_pixel = core.bits_per_pixel;
+        dib_info.compression = BMP_BI_RGB;
+    }
+    else if (header_size >= sizeof(bmpfile_dib_info))
+    {
+        complete = (bool)file.read((char*)(&dib_info) + sizeof(header_size),
+                                   sizeof(dib_info) - sizeof(header_size));
+    }
+    else
+    {
+        log << filename << " has a DIB header of " << header_size
+                  << " bytes, which is not one of the BMP headers.\n";
+        return false;
+    }
+
+    if (complete && extra != NULL)
+    {
+        std::memset(extra, 0, sizeof(*extra));
+
+        // The masks of a BITMAPINFOHEADER follow it; larger headers hold
+        // them, and may be larger still than a BITMAPV5HEADER.
+        size_t size = 0;
+        if (header_size > sizeof(bmpfile_dib_info) && header_size != BMP_OS2_HEADER_SIZE)
+        {
+            size = std::min <size_t> (sizeof(*extra), header_size - sizeof(bmpfile_dib_info));
+        }
+        else if (header_size == sizeof(bmpfile_dib_info))
+        {
+            size = dib_info.compression == BMP_BI_BITFIELDS ? 3 * sizeof(uint32_t)
+                    : dib_info.compression == BMP_BI_ALPHABITFIELDS ? 4 * sizeof(uint32_t) : 0;
+        }
+        complete = (bool)file.read((char*)(extra), size);
+    }
+
+    if (!complete)
+    {
+        log << filename << " is truncated; it ends within its headers.\n";
+        return false;
+    }
+    if (header_size == BMP_OS2_HEADER_SIZE && dib_info.compression > BMP_BI_RLE4)
+    {
+        // 3 and 4 are Huffman and RLE24 here, not BI_BITFIELDS and BI_JPEG.
+        log << filename << " is compressed with OS/2 compression "
+                  << dib_info.compression << ". Bitmap only supports uncompressed "
+                  << "and RLE images.\n";
+        return false;
+    }
+    if (dib_info.width <= 0 || dib_info.width > BMP_MAX_DIMENSION
+            || dib_info.height == 0 || dib_info.height > BMP_MAX_DIMENSION
+            || dib_info.height < -BMP_MAX_DIMENSION)
+    {
+        log << filename << " is not in proper BMP format; it claims to be "
+                  << dib_info.width << " by " << dib_info.height << " pixels.\n";
+        return false;
+    }
+    if (header.bmp_offset < sizeof(bmpfile_magic) + sizeof(bmpfile_header) + header_size)
+    {
+        log << filename << " is not in proper BMP format; its pixels "
+                  << "would overlap its headers.\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief A read-only stream buffer over bytes already in memory, so that the
+ * headers and color table of a BMP held in memory are parsed by the same code
+ * as those of a file, without copying them.
+ */
+class MemoryStreamBuffer : public std::streambuf
+{
+  public:
+    MemoryStreamBuffer(const uchar_t * data, size_t size)
+    {
+        char * begin = (char *)(data);
+        setg(begin, begin, begin + size);
+    }
+
+  protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir way, std::ios_base::openmode)
+    {
+        const off_type base = way == std::ios_base::beg ? 0
+                : way == std::ios_base::cur ? gptr() - eback() : egptr() - eback();
+        if (base + offset < 0 || base + offset > egptr() - eback())
+        {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + base + offset, egptr());
+        return pos_type(base + offset);
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(position), std::ios_base::beg, which);
+    }
+};
+
+/**
+ * @brief Decodes consecutive rows of a pixel array held in memory into their
+ * places in the image, with the kernel of the decoder or, for rows stored
+ * exactly as the image holds them, by copying.
+ *
+ * @param the decoder picked for the file
+ * @param the first of the rows, each decoder.row_bytes long
+ * @param index in the file of the first row
+ * @param number of rows
+ * @param the image to fill, already sized
+ * @param whether the first row of the file is the bottom row of the image
+ */
+static void decodeRows(const RowDecoder & decoder, const uchar_t * data, int first,
+                       int count, PixelBuffer & pixels, bool flip)
+{
+    const size_t row_bytes = decoder.row_bytes;
+    const size_t pixel_bytes = pixels.width() * pixelFormatSize(decoder.format);
+
+    // Bottom-up images store the last row first. Every row is written once,
+    // directly to its final place.
+    if (decoder.decodeRow == NULL && std::abs(pixels.stride()) == (std::ptrdiff_t)row_bytes)
+    {
+        // The rows are laid out in memory exactly as in the file.
+        std::memcpy(pixels.rowData(flip ? pixels.height() - 1 - first : first), data,
+                    row_bytes * count);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const int target = flip ? pixels.height() - 1 - (first + i) : first + i;
+        if (decoder.decodeRow != NULL)
+        {
+            decoder.decodeRow(decoder, data + i * row_bytes, pixels.rowData(target),
+                              pixels.width());
+        }
+        else
+        {
+            std::memcpy(pixels.rowData(target), data + i * row_bytes, pixel_bytes);
+        }
+    }
+}
+
+/**
+ * @brief Packs a matrix of pixels into a buffer of PackedPixels, or leaves the
+ * buffer empty if the matrix is not a proper image.
+ *
+ * Each row is range checked and packed while it is still in cache, so the
+ * pixels are read from memory once rather than once to validate the matrix
+ * and again to pack it. Only the sizes of the rows are looked at up front.
+ *
+ * @param the matrix to pack
+ * @param the same matrix, if each row should be released once it is packed,
+ *        or NULL to leave it untouched
+ * @param the buffer to fill
+ */
+static void packPixelMatrix(const PixelMatrix & values, PixelMatrix * release,
+                            PixelBuffer & pixels)
+{
+    static const PackRowFunction packRow = selectPackRow();
+
+    pixels.clear();
+
+    if( values.empty() || values[0].empty() )
+    {
+        return;
+    }
+
+    for(size_t row=1; row < values.size(); row++)
+    {
+        if( values[row].size() != values[0].size() )
+        {
+            return;
+        }
+    }
+
+    pixels.resize(values[0].size(), values.size());
+
+    for(int row=0; row < pixels.height(); row++)
+    {
+        if( !isPackableRow(&values[row][0], pixels.width()) )
+        {
+            pixels.clear();
+            return;
+        }
+
+        packRow(&values[row][0], pixels.row(row), pixels.width());
+
+        if( release != NULL )
+        {
+            std::vector <Pixel> ().swap((*release)[row]);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+PixelBuffer::PixelBuffer()
+    : data(), origin(NULL), columns(0), rows(0), row_stride(0),
+      pixel_format(PixelFormat::BGR8), pixel_layout(PixelLayout::INTERLEAVED)
+{
+}
+
+PixelBuffer::PixelBuffer(int width, int height, PixelFormat format, bool bottom_up,
+                         PixelLayout layout)
+    : data(), origin(NULL), columns(0), rows(0), row_stride(0),
+      pixel_format(PixelFormat::BGR8), pixel_layout(PixelLayout::INTERLEAVED)
+{
+    resize(width, height, format, bottom_up, layout);
+}
+
+/**
+ * @brief Refers to interleaved pixels in memory the buffer does not own,
+ * leaving the buffer empty if they cannot be described by it.
+ *
+ * The shared pointer starts at the lowest address of the rows, as it does for
+ * bottom-up buffers of its own, and releases nothing; the pixels are copied
+ * only if the buffer is written to while it is shared (see clone).
+**/
+PixelBuffer::PixelBuffer(void * first_row, int width, int height, std::ptrdiff_t stride,
+                         PixelFormat format)
+    : data(), origin(NULL), columns(0), rows(0), row_stride(0),
+      pixel_format(format), pixel_layout(PixelLayout::INTERLEAVED)
+{
+    const size_t channel_size = pixelFormatSize(format) / pixelFormatChannels(format);
+    const uintptr_t address = reinterpret_cast <uintptr_t> (first_row);
+
+    // Every row has to hold its pixels, and every channel has to be aligned
+    // to its own size for the typed accessors.
+    if (first_row == NULL || width <= 0 || height <= 0
+            || (size_t)std::abs(stride) < width * pixelFormatSize(format)
+            || address % channel_size != 0 || (size_t)std::abs(stride) % channel_size != 0)
+    {
+        return;
+    }
+
+    origin = static_cast <unsigned char *> (first_row);
+    data.reset(stride < 0 ? origin + stride * (height - 1) : origin, keepExternal);
+    columns = width;
+    rows = height;
+    row_stride = stride;
+}
+
+PixelBuffer::PixelBuffer(const PixelBuffer & other)
+    : data(other.data), origin(other.origin), columns(other.columns),
+      rows(other.rows), row_stride(other.row_stride),
+      pixel_format(other.pixel_format), pixel_layout(other.pixel_layout)
+{
+}
+
+PixelBuffer & PixelBuffer::operator=(const PixelBuffer & other)
+{
+    if (this != &other)
+    {
+        PixelBuffer copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+PixelBuffer::~PixelBuffer()
+{
+}
+
+/**
+ * @brief Replaces the pixels this buffer shares with others by a copy of them
+ * that only this buffer refers to, keeping the layout of the rows.
+ *
+ * Memory the buffer does not own may end right after the pixels of its last
+ * row, so the stride past them is zeroed rather than copied.
+**/
+void PixelBuffer::clone()
+{
+    const size_t size = std::abs(row_stride) * rows * planes();
+    const size_t used = size - std::abs(row_stride) + width() * pixelFormatSize(pixel_format)
+            / planes();
+    std::shared_ptr <unsigned char> copy(alignedAlloc(size), alignedFree);
+
+    std::memcpy(copy.get(), data.get(), used);
+    std::memset(copy.get() + used, 0, size - used);
+    origin = copy.get() + (origin - data.get());
+    data.swap(copy);
+}
+
+/**
+ * @brief Discards the current contents and reallocates the buffer to hold the
+ * specified number of columns and rows, all initialized to black.
+ *
+ * Each row is rounded up to a whole number of PIXEL_ALIGNMENT-byte blocks so
+ * that every row starts on its own cache line. A bottom-up buffer starts row 0
+ * at the end of the allocation and steps backwards with a negative stride.
+ * A PLANAR buffer holds one such block of rows per channel, one after another.
+ *
+ * @param width (columns) and height (rows) of the new buffer
+ * @param the format to store each pixel in
+ * @param whether the bottom row comes first in memory
+ * @param how the channels of the pixels are arranged
+**/
+void PixelBuffer::resize(int width, int height, PixelFormat format, bool bottom_up,
+                         PixelLayout layout)
+{
+    clear();
+    pixel_format = format;
+    pixel_layout = layout;
+
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    size_t stride = width * pixelFormatSize(format) / planes();
+    stride = (stride + PIXEL_ALIGNMENT - 1) & ~(PIXEL_ALIGNMENT - 1);
+
+    const size_t size = stride * height * planes();
+    data.reset(alignedAlloc(size), alignedFree);
+    columns = width;
+    rows = height;
+
+    if (bottom_up && layout == PixelLayout::INTERLEAVED)
+    {
+        origin = data.get() + stride * (height - 1);
+        row_stride = -(std::ptrdiff_t)stride;
+    }
+    else
+    {
+        origin = data.get();
+        row_stride = stride;
+    }
+
+    // Black is all zero bytes in every format without alpha; formats with
+    // alpha start out transparent.
+    std::memset(data.get(), 0, size);
+}
+
+void PixelBuffer::clear()
+{
+    data.reset();
+    origin = NULL;
+    columns = 0;
+    rows = 0;
+    row_stride = 0;
+}
+
+void PixelBuffer::swap(PixelBuffer & other)
+{
+    std::swap(data, other.data);
+    std::swap(origin, other.origin);
+    std::swap(pixel_format, other.pixel_format);
+    std::swap(pixel_layout, other.pixel_layout);
+    std::swap(columns, other.columns);
+    std::swap(rows, other.rows);
+    std::swap(row_stride, other.row_stride);
+}
+
+
+// ----------------------------------------------------------------------------
+/**
+ * @brief Wraps pixels in memory the Bitmap does not own, without copying them.
+ *
+ * Any errors will be echo'd to cout but will result in an empty matrix (with
+ * no rows and no columns).
+ *
+ * @param pointer to the first byte of the top row
+ * @param width and height of the image in pixels
+ * @param distance in bytes from the start of a row to the row below it;
+ *        negative for rows stored bottom-up
+ * @param the format of the pixels
+**/
+Bitmap::Bitmap(void * first_row, int width, int height, std::ptrdiff_t stride,
+               PixelFormat format)
+    : pixels(first_row, width, height, stride, format)
+{
+    if (pixels.empty())
+    {
+        std::cout << "Bitmap cannot wrap the pixels. They must be a non-empty image whose "
+                  << "stride holds a whole row, aligned to the size of a channel.\n";
+    }
+}
+
+/**
+ * @brief Opens a file as its name is provided and reads pixel-by-pixel the colors
+ * into a matrix of RGB pixels. 
+ * 
+ * Any errors will be echo'd to cout but will result in an empty matrix (with no 
+ * rows and no columns).
+ *
+ * The headers decide how each row is decoded (see selectRowDecoder). Rows
+ * stored exactly as the image holds them are read in place; the others are
+ * read a band at a time and decoded by a kernel picked once per file.
+ * RLE compressed pixels are read whole and expanded by decodeRle.
+ *
+ * @param name of the filename to be opened and read as a matrix of pixels
+**/
+void Bitmap::open(std::string filename)
+{
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    
+    if (file.fail())
+    {
+        std::cout << filename << " could not be opened. Does it exist? "
+                  << "Is it already open by another program?\n";
+        //pixels.resize(0); //make empty if it isn't already
+    }
+    else
+    {
+        // clear data if already holds information
+        pixels.clear();
+
+        bmpfile_header header;
+        bmpfile_dib_info dib_info;
+        bmpfile_v5_info extra;
+
+        // Check to make sure that the file begins with the "BM" identifier
+        // and with headers of a size that identifies a bitmap image. Which
+        // header it is matters no more after this.
+        if (readHeaders(file, filename, header, dib_info, &extra))
+        {
+            // Check for this here so that we know later whether the rows are
+            // stored from the bottom of the image up or from the top down.
+            bool flip = true;
+            if (dib_info.height < 0)
+            {
+                flip = false;
+                dib_info.height = -dib_info.height;
+            }
+
+            // Work out how the pixels are stored, and stop at anything that
+            // cannot be decoded rather than misreading it.
+            RowDecoder decoder;
+            if (!selectRowDecoder(file, filename, dib_info, extra, decoder))
+            {
+                return;
+            }
+
+            // Rows are padded so that they're always a multiple of 4 bytes.
+            const size_t row_bytes = decoder.row_bytes;
+            bool complete = true;
+
+            file.seekg(0, std::ios::end);
+            const std::streamoff file_size = file.tellg();
+            file.seekg(header.bmp_offset);
+
+            // Uncompressed pixels take a known number of bytes, so a file too
+            // short to hold them is turned down before memory is set aside
+            // for the image its headers describe.
+            if (decoder.rle_bits == 0 && (file_size < (std::streamoff)header.bmp_offset
+                    || (uint64_t)(file_size - header.bmp_offset) / row_bytes
+                       < (uint64_t)dib_info.height))
+            {
+                std::cout << filename << " is truncated; it ends before "
+                          << "all of its pixels could be read.\n";
+                return;
+            }
+
+            if (!allocatePixels(pixels, dib_info.width, dib_info.height, decoder, flip,
+                                filename))
+            {
+                return;
+            }
+
+            if (decoder.rle_bits != 0)
+            {
+                // Compressed rows have no fixed size, so the whole pixel
+                // array is read with a single call and decoded from memory.
+                // Its size is often left out of the headers, and is never
+                // trusted beyond the end of the file.
+                size_t size = std::max <std::streamoff> (0, file_size - header.bmp_offset);
+                if (dib_info.bmp_byte_size != 0)
+                {
+                    size = std::min <size_t> (size, dib_info.bmp_byte_size);
+                }
+
+                std::vector <uchar_t> data(size + 1);
+                file.read((char*)(&data[0]), size);
+                complete = decodeRle(decoder, &data[0], file.gcount(), pixels, flip);
+            }
+            else if (decoder.decodeRow == NULL
+                    && std::abs(pixels.stride()) == (std::ptrdiff_t)row_bytes)
+            {
+                // The rows in memory are laid out exactly as in the file, so
+                // the whole pixel array is read in place with a single call.
+                unsigned char * first = pixels.rowData(flip ? pixels.height() - 1 : 0);
+                complete = !pixels.empty()
+                        && file.read((char*)(first), row_bytes * pixels.height());
+            }
+            else
+            {
+                const int band_rows = std::max <size_t> (1, IO_CHUNK_BYTES / (row_bytes + 1));
+                std::vector <uchar_t> band(row_bytes * band_rows + 1);
+
+                // Read as many whole rows as fit in the band buffer with a
+                // single call, then copy or decode each row of it into the
+                // image.
+                for (int row = 0; row < pixels.height() && complete; row += band_rows)
+                {
+                    const int count = std::min(band_rows, pixels.height() - row);
+
+                    complete = (bool)file.read((char*)(&band[0]), row_bytes * count);
+                    if (complete)
+                    {
+                        decodeRows(decoder, &band[0], row, count, pixels, flip);
+                    }
+                }
+            }
+
+            if (complete && dib_info.compression == BMP_BI_RGB && dib_info.bits_per_pixel == 32)
+            {
+                makeOpaqueIfNoAlpha(pixels);
+            }
+
+            if (!complete && !pixels.empty())
+            {
+                std::cout << filename << " is truncated; it ends before "
+                          << "all of its pixels could be read.\n";
+                pixels.clear();
+            }
+
+            file.close();
+        }//end if (is an image)
+    }//end else (can open file)
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * @brief Decodes a whole BMP file held in memory, such as one received over
+ * a network or read from an archive, into the matrix of pixels.
+ *
+ * Any errors will be echo'd to cout but will result in an empty matrix (with
+ * no rows and no columns).
+ *
+ * The headers and color table are parsed through a stream over the bytes
+ * themselves, by the same code as open uses. The pixels are then decoded
+ * straight from memory by the same kernels, with no band buffer: rows stored
+ * exactly as the image holds them are copied with one call, and RLE
+ * compressed pixels are expanded by decodeRle where they lie.
+ *
+ * @param the bytes of the file
+ * @param number of bytes
+**/
+void Bitmap::decode(const void * data, size_t size)
+{
+    static const std::string name = "The BMP data";
+    const uchar_t * bytes = (const uchar_t *)(data);
+    MemoryStreamBuffer buffer(bytes, size);
+    std::istream stream(&buffer);
+
+    pixels.clear();
+
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+    bmpfile_v5_info extra;
+
+    if (!readHeaders(stream, name, header, dib_info, &extra))
+    {
+        return;
+    }
+
+    bool flip = true;
+    if (dib_info.height < 0)
+    {
+        flip = false;
+        dib_info.height = -dib_info.height;
+    }
+
+    RowDecoder decoder;
+    if (!selectRowDecoder(stream, name, dib_info, extra, decoder))
+    {
+        return;
+    }
+
+    // The pixel array runs to the end of the data, or for compressed pixels
+    // to the size the headers give it if that is smaller.
+    const size_t offset = std::min <size_t> (header.bmp_offset, size);
+    size_t available = size - offset;
+    bool complete;
+
+    // Uncompressed pixels take a known number of bytes, so data too short to
+    // hold them is turned down before memory is set aside for the image its
+    // headers describe. Dividing keeps the comparison from overflowing.
+    if (decoder.rle_bits == 0 && available / decoder.row_bytes < (size_t)dib_info.height)
+    {
+        std::cout << name << " is truncated; it ends before "
+                  << "all of its pixels could be read.\n";
+        return;
+    }
+
+    if (!allocatePixels(pixels, dib_info.width, dib_info.height, decoder, flip, name))
+    {
+        return;
+    }
+
+    if (decoder.rle_bits != 0)
+    {
+        if (dib_info.bmp_byte_size != 0)
+        {
+            available = std::min <size_t> (available, dib_info.bmp_byte_size);
+        }
+        complete = decodeRle(decoder, bytes + offset, available, pixels, flip);
+    }
+    else
+    {
+        complete = !pixels.empty();
+        if (complete)
+        {
+            decodeRows(decoder, bytes + offset, 0, pixels.height(), pixels, flip);
+        }
+    }
+
+    if (complete && dib_info.compression == BMP_BI_RGB && dib_info.bits_per_pixel == 32)
+    {
+        makeOpaqueIfNoAlpha(pixels);
+    }
+
+    if (!complete && !pixels.empty())
+    {
+        std::cout << name << " is truncated; it ends before "
+                  << "all of its pixels could be read.\n";
+        pixels.clear();
+    }
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * @brief Opens a file as its name is provided and reads only the pixels of a
+ * rectangular region of it, which becomes the whole bitmap.
+ *
+ * Each row of the region is read from its offset in the file straight into
+ * memory with a single read of just the region's columns, in file order, so the cost depends on
+ * the size of the region rather than the size of the image. The region is
+ * clipped to the image. Any errors will be echo'd to cout but will result in
+ * an empty matrix (with no rows and no columns).
+ *
+ * @param name of the filename to be opened
+ * @param column and row of the top-left corner of the region
+ * @param width and height of the region
+**/
+void Bitmap::openRegion(std::string filename, int x, int y, int width, int height)
+{
+    pixels.clear();
+
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+
+    if (file.fail())
+    {
+        std::cout << filename << " could not be opened. Does it exist? "
+                  << "Is it already open by another program?\n";
+        return;
+    }
+
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+
+    if (!readHeaders(file, filename, header, dib_info))
+    {
+        return;
+    }
+
+    if (dib_info.bits_per_pixel != 24 || dib_info.compression != 0)
+    {
+        std::cout << filename << " cannot be read by region. Only "
+                  << "uncompressed 24bit images can be.\n";
+        return;
+    }
+
+    const bool flip = dib_info.height > 0;
+    const int image_height = flip ? dib_info.height : -dib_info.height;
+
+    // Clip the region to the image.
+    const int left = std::max(x, 0);
+    const int top = std::max(y, 0);
+    const int right = std::min((int64_t)x + width, (int64_t)dib_info.width);
+    const int bottom = std::min((int64_t)y + height, (int64_t)image_height);
+
+    if (left >= right || top >= bottom)
+    {
+        std::cout << "The region does not overlap " << filename << ".\n";
+        return;
+    }
+
+    // Rows are padded so that they're always a multiple of 4 bytes.
+    const size_t row_bytes = bmpRowBytes(dib_info.width, 24);
+    const int columns = right - left;
+
+    pixels.resize(columns, bottom - top, PixelFormat::BGR8, flip);
+
+    // Visit the rows in the order they are stored, so that the reads move
+    // forward through the file.
+    for (int i = 0; i < pixels.height(); i++)
+    {
+        const int row = flip ? bottom - 1 - i : top + i;
+        const int file_row = flip ? image_height - 1 - row : row;
+
+        file.seekg(header.bmp_offset + (uint64_t)file_row * row_bytes + left * 3);
+
+        // The file stores pixels in the same form as memory does, so the
+        // span is read straight into its row.
+        if (!file.read((char*)(pixels.row(row - top)), columns * sizeof(PackedPixel)))
+        {
+            std::cout << filename << " is truncated; it ends before "
+                      << "all of its pixels could be read.\n";
+            pixels.clear();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief How an image is written as a BMP file, worked out once for save and
+ * encode alike: the depth and color table of the file, the kernel that turns
+ * each row of the image into a row of the file, and the compressed pixels if
+ * the file is RLE8.
+ *
+ * Images with alpha are saved as 32-bit files that keep it, images with
+ * 16-bit channels as 48- or 64-bit files that keep their precision, gray
+ * images and images of at most 256 colors as indexed files, and all others
+ * as 24-bit files -- unless 16-bit pixels are asked for, which every image is
+ * packed into. Everything about the file, its size included, is known once
+ * the encoder is made, before any pixels are written.
+ */
+class BmpEncoder
+{
+  private:
+    const PixelBuffer & pixels;
+    const BitmapSaveOptions & options;
+    PixelFormat file_format;
+    int bits_per_pixel;
+    ColorTable table;
+    bool index_rows;
+    SwapRowFunction swapRow;
+    Pack16RowFunction pack16Row;
+    int green_bits;
+    size_t row_bytes;
+    size_t pixel_bytes;
+    std::vector <uchar_t> headers;
+    std::vector <uchar_t> encoded;
+    std::unique_ptr <RowConverter> rows;
+
+  public:
+    BmpEncoder(const PixelBuffer & source, const BitmapSaveOptions & choices)
+        : pixels(source), options(choices), file_format(PixelFormat::BGR8), bits_per_pixel(24),
+          index_rows(false), swapRow(NULL), pack16Row(NULL),
+          green_bits(choices.packed == PackedFormat::RGB565 ? 6 : 5)
+    {
+        static const uint32_t rgb565_masks[3] = { 0xF800, 0x07E0, 0x001F };
+
+        if (options.packed != PackedFormat::UNPACKED)
+        {
+            bits_per_pixel = 16;
+            pack16Row = selectPackRgb16Row();
+        }
+        else if (pixels.format() == PixelFormat::BGRA8)
+        {
+            file_format = PixelFormat::BGRA8;
+            bits_per_pixel = 32;
+        }
+        else if (pixels.format() == PixelFormat::RGBA16)
+        {
+            file_format = PixelFormat::RGBA16;
+            bits_per_pixel = 64;
+            swapRow = selectSwapRedBlue16 <4> ();
+        }
+        else if (pixels.format() == PixelFormat::RGB16 || pixels.format() == PixelFormat::GRAY16)
+        {
+            file_format = PixelFormat::RGB16;
+            bits_per_pixel = 48;
+            swapRow = selectSwapRedBlue16 <3> ();
+        }
+        else if ((options.indexed || options.rle8) && pixels.format() == PixelFormat::GRAY8)
+        {
+            // Gray levels are their own indices into a ramp of grays.
+            file_format = PixelFormat::GRAY8;
+            bits_per_pixel = 8;
+            for (int level = 0; level <= MAX_RGB; level++)
+            {
+                table.colors[level] = level * 0x010101u;
+            }
+        }
+        else if (options.indexed || options.rle8)
+        {
+            // Photographs have more than 256 colors within their first few
+            // rows, so this usually stops long before the end of the image.
+            RowConverter scan(pixels, PixelFormat::BGR8);
+            index_rows = true;
+            for (int row = 0; row < pixels.height() && index_rows; row++)
+            {
+                index_rows = table.addRow(scan.row(row), pixels.width());
+            }
+            if (index_rows)
+            {
+                table.sort();
+                bits_per_pixel = table.bitsPerPixel();
+            }
+        }
+        const int colors = bits_per_pixel > 8 ? 0
+                : file_format == PixelFormat::GRAY8 ? MAX_RGB + 1 : table.size();
+
+        // Rows are padded so that they're always a multiple of 4 bytes.
+        row_bytes = bmpRowBytes(pixels.width(), bits_per_pixel);
+        pixel_bytes = ((size_t)pixels.width() * bits_per_pixel + 7) / 8;
+        rows.reset(new RowConverter(pixels, file_format));
+
+        if (options.rle8 && bits_per_pixel <= 8)
+        {
+            // RLE8 encodes indices a byte each whatever their number.
+            std::vector <uint8_t> indices(pixels.width());
+
+            for (int row = pixels.height() - 1; row >= 0; row--)
+            {
+                const uint8_t * source = rows->row(row);
+                if (index_rows)
+                {
+                    table.indexRow(source, &indices[0], pixels.width(), 8);
+                    source = &indices[0];
+                }
+
+                encodeRle8Row(source, pixels.width(), encoded);
+                encoded.push_back(0);
+                encoded.push_back(row == 0 ? 1 : 0);
+            }
+
+            // Noisy images grow rather than shrink, and are written
+            // uncompressed instead.
+            if (encoded.size() >= row_bytes * pixels.height())
+            {
+                encoded.clear();
+            }
+        }
+
+        headers.resize(sizeof(bmpfile_magic) + sizeof(bmpfile_header)
+                       + BMP_V4_HEADER_SIZE + sizeof(table.colors));
+        headers.resize(packHeaders(&headers[0], pixels.width(), pixels.height(),
+                                   encoded.empty() ? bits_per_pixel : 8, table.colors,
+                                   colors, encoded.size(),
+                                   options.packed == PackedFormat::RGB565 ? rgb565_masks : NULL));
+    }
+
+    // The magic bytes, headers, masks and color table that start the file.
+    const std::vector <uchar_t> & headerBytes() const { return headers; }
+
+    // The RLE8 pixel array, or nothing if the rows are written uncompressed.
+    const std::vector <uchar_t> & compressed() const { return encoded; }
+
+    // Size of each padded row of an uncompressed file.
+    size_t rowBytes() const { return row_bytes; }
+
+    // Exact size of the whole file.
+    size_t fileSize() const
+    {
+        return headers.size()
+                + (encoded.empty() ? row_bytes * pixels.height() : encoded.size());
+    }
+
+    // The rows in memory if they are bottom-up and laid out exactly as in
+    // the file, so that the pixel array is a copy of them all, else NULL.
+    const unsigned char * rowsInPlace() const
+    {
+        return encoded.empty() && !index_rows && swapRow == NULL && pack16Row == NULL
+                && pixels.format() == file_format && pixels.layout() == PixelLayout::INTERLEAVED
+                && pixels.stride() == -(std::ptrdiff_t)row_bytes
+                ? pixels.rowData(pixels.height() - 1) : NULL;
+    }
+
+    // Converts, indexes, swaps or packs one row of an uncompressed file into
+    // place, padding included. Rows are counted from the bottom of the image
+    // up, the order the file stores them in.
+    void encodeRow(int file_row, uchar_t * target)
+    {
+        const int row = pixels.height() - 1 - file_row;
+
+        if (index_rows)
+        {
+            table.indexRow(rows->row(row), target, pixels.width(), bits_per_pixel);
+        }
+        else if (swapRow != NULL)
+        {
+            swapRow(rows->row(row), target, pixels.width());
+        }
+        else if (pack16Row != NULL)
+        {
+            pack16Row(rows->row(row), target, pixels.width(), green_bits,
+                      options.dither ? DITHER_OFFSETS[row & 3] : ROUND_OFFSETS);
+        }
+        else
+        {
+            std::memcpy(target, rows->row(row), pixel_bytes);
+        }
+        std::memset(target + pixel_bytes, 0, row_bytes - pixel_bytes);
+    }
+
+    // Writes the whole file into memory of at least fileSize() bytes.
+    void encode(uchar_t * target)
+    {
+        std::memcpy(target, &headers[0], headers.size());
+        target += headers.size();
+
+        if (!encoded.empty())
+        {
+            std::memcpy(target, &encoded[0], encoded.size());
+        }
+        else if (rowsInPlace() != NULL)
+        {
+            std::memcpy(target, rowsInPlace(), row_bytes * pixels.height());
+        }
+        else
+        {
+            for (int row = 0; row < pixels.height(); row++)
+            {
+                encodeRow(row, target + row * row_bytes);
+            }
+        }
+    }
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * Saves the current image, represented by the matrix of pixels, as a
+ * Windows BMP file with the name provided by the parameter. File extension
+ * is not forced but should be .bmp. Any errors will cout and will NOT 
+ * attempt to save the file.
+ *
+ * BmpEncoder decides what kind of file to write. Its rows are assembled a
+ * band at a time and each band written with one call, or written straight
+ * from memory when they are stored exactly as the file stores them.
+ *
+ * @param name of the filename to be written as a bmp image
+ * @param choices about the kind of file to write
+**/
+void Bitmap::save(std::string filename, const BitmapSaveOptions & options) const
+{
+    std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+
+    if (file.fail())
+    {
+        std::cout<<filename<<" could not be opened for editing. "
+                 <<"Is it already open by another program or is it read-only?\n";
+        
+    }
+    else if( !isImage() )
+    {
+        std::cout<<"Bitmap cannot be saved. It is not a valid image.\n";
+    }
+    else
+    {
+        BmpEncoder encoder(pixels, options);
+        const std::vector <uchar_t> & headers = encoder.headerBytes();
+
+        if (!encoder.compressed().empty())
+        {
+            file.write((char*)(&headers[0]), headers.size());
+            file.write((char*)(&encoder.compressed()[0]), encoder.compressed().size());
+        }
+        else if (encoder.rowsInPlace() != NULL)
+        {
+            // The rows are written straight from memory in one call.
+            file.write((char*)(&headers[0]), headers.size());
+            file.write((char*)(encoder.rowsInPlace()),
+                       encoder.rowBytes() * pixels.height());
+        }
+        else
+        {
+            // Write all the header information that the BMP file format requires
+            // at the start of the first band.
+            const size_t row_bytes = encoder.rowBytes();
+            std::vector <uchar_t> band(std::max(IO_CHUNK_BYTES, headers.size() + row_bytes));
+            size_t used = headers.size();
+            std::memcpy(&band[0], &headers[0], used);
+
+            // Images in other formats are converted on the way, and planar
+            // images are merged back into pixels first. Each row is encoded
+            // into the band, which is written out each time it fills up.
+            for (int row = 0; row < pixels.height() && file; row++)
+            {
+                if (used + row_bytes > band.size())
+                {
+                    file.write((char*)(&band[0]), used);
+                    used = 0;
+                }
+
+                encoder.encodeRow(row, &band[used]);
+                used += row_bytes;
+            }
+
+            file.write((char*)(&band[0]), used);
+        }
+
+        if (!file)
+        {
+            std::cout<<filename<<" could not be written completely. "
+                     <<"Is the disk full?\n";
+        }
+
+        file.close();
+    }
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Serializes the current image into memory as the complete BMP file save
+ * would write, into a buffer of the caller's. The exact size of the file is
+ * worked out before anything is written, and nothing is written unless the
+ * buffer holds it all, so the size can be asked for with a null buffer first.
+ *
+ * @param where to write the file
+ * @param number of bytes the buffer holds
+ * @param choices about the kind of file to write
+ * @return the size of the file, or 0 if the image is not valid
+**/
+size_t Bitmap::encode(void * buffer, size_t capacity, const BitmapSaveOptions & options) const
+{
+    if (!isImage())
+    {
+        std::cout<<"Bitmap cannot be encoded. It is not a valid image.\n";
+        return 0;
+    }
+
+    BmpEncoder encoder(pixels, options);
+    const size_t size = encoder.fileSize();
+    if (buffer != NULL && capacity >= size)
+    {
+        encoder.encode((uchar_t *)(buffer));
+    }
+    return size;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Serializes the current image into memory as the complete BMP file save
+ * would write, replacing the contents of a vector that grows to fit it. A
+ * vector reused from one image to the next keeps its capacity, so files of
+ * similar sizes are encoded without allocating.
+ *
+ * @param the vector to fill with the file; emptied if the image is not valid
+ * @param choices about the kind of file to write
+**/
+void Bitmap::encode(std::vector <unsigned char> & target, const BitmapSaveOptions & options) const
+{
+    if (!isImage())
+    {
+        std::cout<<"Bitmap cannot be encoded. It is not a valid image.\n";
+        target.clear();
+        return;
+    }
+
+    // Every byte is overwritten, so only bytes the vector grows by are
+    // zeroed first.
+    BmpEncoder encoder(pixels, options);
+    target.resize(encoder.fileSize());
+    encoder.encode(&target[0]);
+}
+    
+// ----------------------------------------------------------------------------
+/**
+  * Validates whether or not the current matrix of pixels represents a
+  * proper image with non-zero-size rows and consistent non-zero-size
+  * columns for each row. The components of every pixel are stored in a
+  * byte each, so they always have values between 0 and 255
+  *
+  * @return boolean value of whether or not the matrix is a valid image
+ **/
+bool Bitmap::isImage() const
+{
+    // The buffer is rectangular by construction and its components cannot
+    // leave the range 0 to 255, so only its size needs checking.
+    return !pixels.empty();
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Scans a matrix of pixels for whether it is a proper image: at least one
+ * row, every row the same non-zero size, and every component between 0 and
+ * 255. Unlike isImage, this has to look at every pixel, because nothing
+ * constrains what a PixelMatrix holds.
+ *
+ * @param a matrix of pixels to check
+ * @return whether fromPixelMatrix would accept the matrix
+**/
+bool Bitmap::validate(const PixelMatrix & values)
+{
+    if( values.empty() || values[0].empty() )
+    {
+        return false;
+    }
+
+    for(size_t row=0; row < values.size(); row++)
+    {
+        if( values[row].size() != values[0].size()
+                || !isPackableRow(&values[row][0], values[row].size()) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Converts every pixel of the image to another PixelFormat. The pair of
+ * formats is looked up once and the conversion then runs as a loop
+ * specialized at compile time for that pair.
+ *
+ * @param the format to store the pixels in from now on
+**/
+void Bitmap::convert(PixelFormat format)
+{
+    if( format == pixels.format() )
+    {
+        return;
+    }
+
+    if( pixels.layout() == PixelLayout::PLANAR )
+    {
+        // The conversions work on whole pixels, so planar images are merged
+        // for the conversion and split again afterwards.
+        setLayout(PixelLayout::INTERLEAVED);
+        convert(format);
+        setLayout(PixelLayout::PLANAR);
+        return;
+    }
+
+    const PixelBuffer & source = pixels;
+    PixelBuffer converted(pixels.width(), pixels.height(), format, pixels.bottomUp());
+    const ConvertRowFunction convertRow = selectConvertRow(pixels.format(), format);
+
+    for(int row=0; row < converted.height(); row++)
+    {
+        convertRow(source.rowData(row), converted.rowData(row), pixels.width());
+    }
+
+    pixels.swap(converted);
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Rearranges the channels of every pixel of the image. Each row is split into
+ * or merged from the planes with a kernel picked once for the format, which
+ * moves sixteen 8-bit pixels per step on CPUs with SSSE3.
+ *
+ * @param the layout to store the pixels in from now on
+**/
+void Bitmap::setLayout(PixelLayout layout)
+{
+    if( layout == pixels.layout() )
+    {
+        return;
+    }
+
+    if( pixels.empty() )
+    {
+        pixels.resize(0, 0, pixels.format(), false, layout);
+        return;
+    }
+
+    // Reading through a const reference leaves pixels shared with other
+    // buffers alone rather than copying them first.
+    const PixelBuffer & source = pixels;
+    PixelBuffer arranged(pixels.width(), pixels.height(), pixels.format(),
+                         pixels.bottomUp(), layout);
+
+    if( layout == PixelLayout::PLANAR )
+    {
+        const SplitRowFunction splitRow = selectSplitRow(pixels.format());
+        unsigned char * planes[4];
+
+        for(int row=0; row < pixels.height(); row++)
+        {
+            for(int p=0; p < arranged.planes(); p++)
+            {
+                planes[p] = arranged.planeData(p, row);
+            }
+            splitRow(source.rowData(row), planes, pixels.width());
+        }
+    }
+    else
+    {
+        const MergeRowFunction mergeRow = selectMergeRow(pixels.format());
+
+        for(int row=0; row < pixels.height(); row++)
+        {
+            mergeBufferRow(mergeRow, source, row, arranged.rowData(row));
+        }
+    }
+
+    pixels.swap(arranged);
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Provides a vector of vector of pixels representing the bitmap
+ *
+ * @return the bitmap image, represented by a matrix of RGB pixels
+**/
+PixelMatrix Bitmap::toPixelMatrix() const
+{
+    PixelMatrix matrix;
+    static const ExpandRowFunction expandRow = selectExpandRow();
+
+    if( isImage() )
+    {
+        // Images in other formats go through BGR8 a row at a time, and
+        // planar images are merged back into pixels first.
+        RowConverter rows(pixels, PixelFormat::BGR8);
+
+        matrix.resize(pixels.height());
+        for(int row=0; row < pixels.height(); row++)
+        {
+            const PackedPixel * source =
+                    reinterpret_cast <const PackedPixel *> (rows.row(row));
+
+            matrix[row].resize(pixels.width());
+            expandRow(source, &matrix[row][0], pixels.width());
+        }
+    }
+
+    return matrix;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Provides a vector of vector of pixels representing the bitmap and leaves
+ * the bitmap empty, releasing its own copy of the image.
+ *
+ * @return the bitmap image, represented by a matrix of RGB pixels
+**/
+PixelMatrix Bitmap::takePixelMatrix()
+{
+    PixelMatrix matrix = toPixelMatrix();
+    pixels.clear();
+    return matrix;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Overwrites the current bitmap with that represented by a matrix of
+ * pixels. A matrix that is not rectangular, or that has a component
+ * outside of 0 to 255, is not a proper image and leaves the bitmap empty.
+ *
+ * The matrix is packed into contiguous storage of PackedPixels, which can hold
+ * neither a ragged matrix nor components out of range. Leaving the bitmap
+ * empty instead makes isImage() report it as invalid, just as it would have
+ * the improper matrix. This is the one place the pixels of an image are
+ * checked; from here on isImage() relies on them staying valid.
+ *
+ * @param a matrix of pixels to represent a bitmap
+**/
+void Bitmap::fromPixelMatrix(const PixelMatrix & values)
+{
+    packPixelMatrix(values, NULL, pixels);
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Overwrites the current bitmap with that represented by a matrix of
+ * pixels that is no longer needed, releasing each row of the matrix as soon
+ * as it has been packed and leaving the matrix empty.
+ *
+ * @param a matrix of pixels to represent a bitmap
+**/
+void Bitmap::fromPixelMatrix(PixelMatrix && values)
+{
+    packPixelMatrix(values, &values, pixels);
+    values.clear();
+}
+
+// ----------------------------------------------------------------------------
+MappedBitmap::MappedBitmap()
+    : base(NULL), length(0), writable(false), origin(NULL),
+      columns(0), rows(0), row_stride(0)
+{
+}
+
+MappedBitmap::MappedBitmap(MappedBitmap && other)
+    : base(other.base), length(other.length), writable(other.writable),
+      origin(other.origin), columns(other.columns), rows(other.rows),
+      row_stride(other.row_stride), filename(other.filename)
+{
+    other.base = NULL;
+    other.close();
+}
+
+MappedBitmap & MappedBitmap::operator=(MappedBitmap && other)
+{
+    if (this != &other)
+    {
+        close();
+        std::swap(base, other.base);
+        std::swap(length, other.length);
+        std::swap(writable, other.writable);
+        std::swap(origin, other.origin);
+        std::swap(columns, other.columns);
+        std::swap(rows, other.rows);
+        std::swap(row_stride, other.row_stride);
+        std::swap(filename, other.filename);
+    }
+    return *this;
+}
+
+MappedBitmap::~MappedBitmap()
+{
+    close();
+}
+
+/**
+ * @brief Maps a file as its name is provided and checks in place that it is
+ * an uncompressed 24-bit BMP whose pixel array lies within the file.
+ *
+ * Where memory mapping is not available the file is read into memory instead
+ * and sync() writes it back, so the interface behaves the same everywhere.
+ * Any errors will be echo'd to cout and leave the MappedBitmap closed.
+ *
+ * @param name of the file to be mapped
+ * @param whether changes to the pixels should be written to the file
+**/
+void MappedBitmap::open(std::string name, bool write)
+{
+    close();
+
+    unsigned char * mapped = NULL;
+    size_t size = 0;
+
+#ifdef BITMAP_HAVE_MMAP
+    int fd = ::open(name.c_str(), write ? O_RDWR : O_RDONLY);
+    struct stat status;
+
+    if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        size = status.st_size;
+        void * address = mmap(NULL, size, write ? PROT_READ | PROT_WRITE : PROT_READ,
+                              MAP_SHARED, fd, 0);
+        if (address != MAP_FAILED)
+        {
+            mapped = static_cast <unsigned char *> (address);
+        }
+    }
+    if (fd >= 0)
+    {
+        // The mapping stays valid after its descriptor is closed.
+        ::close(fd);
+    }
+#else
+    std::ifstream file(name.c_str(), std::ios::in | std::ios::binary);
+    if (file.seekg(0, std::ios::end))
+    {
+        size = file.tellg();
+        file.seekg(0);
+        if (size > 0)
+        {
+            mapped = alignedAlloc(size);
+            if (!file.read((char*)(mapped), size))
+            {
+                alignedFree(mapped);
+                mapped = NULL;
+            }
+        }
+    }
+#endif
+
+    if (mapped == NULL)
+    {
+        std::cout << name << " could not be mapped. Does it exist? "
+                  << "Is it already open by another program?\n";
+        return;
+    }
+
+    base = mapped;
+    length = size;
+    writable = write;
+    filename = name;
+
+    // The headers are parsed through a stream over the mapping, by the same
+    // code and with the same checks as every other reader.
+    MemoryStreamBuffer buffer(base, length);
+    std::istream stream(&buffer);
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+
+    if (!readHeaders(stream, name, header, dib_info))
+    {
+        close();
+        return;
+    }
+
+    if (dib_info.bits_per_pixel != 24 || dib_info.compression != BMP_BI_RGB)
+    {
+        std::cout << name << " cannot be mapped. Only uncompressed 24bit "
+                  << "images can be used in place.\n";
+        close();
+        return;
+    }
+
+    const bool flip = dib_info.height > 0;
+    const int64_t height = flip ? (int64_t)dib_info.height : -(int64_t)dib_info.height;
+
+    // Rows are padded so that they're always a multiple of 4 bytes.
+    const uint64_t row_bytes = bmpRowBytes(dib_info.width, 24);
+
+    if (header.bmp_offset > length || row_bytes * height > length - header.bmp_offset)
+    {
+        std::cout << name << " is truncated; its pixels do not fit "
+                  << "inside the file.\n";
+        close();
+        return;
+    }
+
+    columns = dib_info.width;
+    rows = height;
+
+    // Present the rows top-down: bottom-up files start from their last row
+    // and step backwards through the file.
+    if (flip)
+    {
+        origin = base + header.bmp_offset + row_bytes * (rows - 1);
+        row_stride = -(std::ptrdiff_t)row_bytes;
+    }
+    else
+    {
+        origin = base + header.bmp_offset;
+        row_stride = row_bytes;
+    }
+}
+
+/**
+ * @brief Writes any changes made through a writable map back to the file and
+ * waits for them to complete. Does nothing for a read-only map.
+**/
+void MappedBitmap::sync()
+{
+    if (base == NULL || !writable)
+    {
+        return;
+    }
+
+#ifdef BITMAP_HAVE_MMAP
+    if (msync(base, length, MS_SYNC) != 0)
+#else
+    std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!file.write((char*)(base), length))
+#endif
+    {
+        std::cout << filename << " could not be written back. "
+                  << "Is it read-only?\n";
+    }
+}
+
+/**
+ * @brief Writes back any changes, then unmaps the file.
+**/
+void MappedBitmap::close()
+{
+    if (base != NULL)
+    {
+        sync();
+#ifdef BITMAP_HAVE_MMAP
+        munmap(base, length);
+#else
+        alignedFree(base);
+#endif
+    }
+
+    base = NULL;
+    length = 0;
+    writable = false;
+    origin = NULL;
+    columns = 0;
+    rows = 0;
+    row_stride = 0;
+    filename.clear();
+}
+
+// ----------------------------------------------------------------------------
+BitmapReader::BitmapReader()
+    : columns(0), rows(0), flip(false), pixel_offset(0), window_bytes(0),
+      window_first(0)
+{
+}
+
+/**
+ * @brief Opens a file as its name is provided and reads its headers. No pixels
+ * are read until they are asked for.
+ *
+ * Any errors will be echo'd to cout and leave the BitmapReader closed.
+ *
+ * @param name of the file to be read
+ * @param the most memory, in bytes, to hold decoded rows in
+**/
+void BitmapReader::open(std::string name, size_t window_size)
+{
+    close();
+
+    file.open(name.c_str(), std::ios::in | std::ios::binary);
+
+    if (file.fail())
+    {
+        std::cout << name << " could not be opened. Does it exist? "
+                  << "Is it already open by another program?\n";
+        close();
+        return;
+    }
+
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+
+    if (!readHeaders(file, name, header, dib_info))
+    {
+        close();
+        return;
+    }
+
+    if (dib_info.bits_per_pixel != 24 || dib_info.compression != 0
+            || dib_info.width <= 0 || dib_info.height == 0)
+    {
+        std::cout << name << " cannot be streamed. Only uncompressed 24bit "
+                  << "images can be read a band at a time.\n";
+        close();
+        return;
+    }
+
+    filename = name;
+    columns = dib_info.width;
+    flip = dib_info.height > 0;
+    rows = flip ? dib_info.height : -dib_info.height;
+    pixel_offset = header.bmp_offset;
+    window_bytes = window_size;
+}
+
+/**
+ * @brief Closes the file and releases the window.
+**/
+void BitmapReader::close()
+{
+    if (file.is_open())
+    {
+        file.close();
+    }
+    file.clear();
+    filename.clear();
+    columns = 0;
+    rows = 0;
+    flip = false;
+    pixel_offset = 0;
+    window_bytes = 0;
+    window.clear();
+    window_first = 0;
+}
+
+/**
+ * @brief Provides a row of the image, reading the band of rows that starts
+ * with it into the window if it is not held already.
+ *
+ * @param index of the row, where 0 is the top of the image
+ * @return pointer to the Pixels of the row, or NULL if the row does not exist
+ *         or cannot be read
+**/
+const PackedPixel * BitmapReader::row(int y)
+{
+    if (y < window_first || y >= window_first + window.height())
+    {
+        if (readBand(y) == 0)
+        {
+            return NULL;
+        }
+    }
+    return window.row(y - window_first);
+}
+
+/**
+ * @brief Reads the band of rows that starts with a given row into the window.
+ *
+ * The rows of a band are next to each other in the file whichever way up it
+ * is stored, so a band is read with one seek and as few reads as the I/O
+ * chunk size allows. The window keeps the rows in file order, so bottom-up
+ * bands are held with a negative stride.
+ *
+ * @param index of the first row of the band, where 0 is the top
+ * @return number of rows now held, or 0 if the row does not exist or cannot
+ *         be read
+**/
+int BitmapReader::readBand(int y)
+{
+    if (!isOpen() || y < 0 || y >= rows)
+    {
+        return 0;
+    }
+
+    // Rows are padded so that they're always a multiple of 4 bytes.
+    const size_t row_bytes = bmpRowBytes(columns, 24);
+    // Limited while still a size_t, since a window may be as large as memory.
+    const size_t window_rows =
+            std::max <size_t> (1, window_bytes / (columns * sizeof(PackedPixel)));
+    const int count = (int)std::min <size_t> (window_rows, rows - y);
+    const int chunk_rows = std::max <size_t> (1, IO_CHUNK_BYTES / row_bytes);
+
+    // The first row of the band in file order.
+    const int first = flip ? rows - y - count : y;
+
+    if (window.width() != columns || window.height() != count)
+    {
+        window.resize(columns, count, PixelFormat::BGR8, flip);
+    }
+    window_first = y;
+
+    std::vector <uchar_t> chunk(row_bytes * std::min(chunk_rows, count));
+
+    file.clear();
+    file.seekg(pixel_offset + (uint64_t)first * row_bytes);
+
+    for (int done = 0; done < count; done += chunk_rows)
+    {
+        const int chunk_count = std::min(chunk_rows, count - done);
+
+        if (!file.read((char*)(&chunk[0]), row_bytes * chunk_count))
+        {
+            std::cout << filename << " is truncated; it ends before "
+                      << "all of its pixels could be read.\n";
+            window.clear();
+            return 0;
+        }
+
+        for (int i = 0; i < chunk_count; i++)
+        {
+            const int target = flip ? count - 1 - (done + i) : done + i;
+            std::memcpy(window.row(target), &chunk[i * row_bytes],
+                        columns * sizeof(PackedPixel));
+        }
+    }
+
+    return count;
+}
+
+// ----------------------------------------------------------------------------
+BitmapWriter::BitmapWriter() : columns(0), rows(0), flip(true)
+{
+}
+
+/**
+ * @brief Creates a file as its name is provided and writes the headers for an
+ * image of the given size.
+ *
+ * The file reserves the space for all of its rows by writing its last byte,
+ * so that rows can be written at their offsets in any order and rows never
+ * written still read back as black, whichever way up the file is stored.
+ * Any errors will be echo'd to cout and leave the BitmapWriter closed.
+ *
+ * @param name of the file to be written
+ * @param width and height of the image
+ * @param whether the rows are stored bottom-up, as most readers expect
+**/
+void BitmapWriter::open(std::string name, int width, int height, bool bottom_up)
+{
+    close();
+
+    if (width <= 0 || height <= 0)
+    {
+        std::cout << name << " cannot be written. An image needs at least "
+                  << "one row and one column.\n";
+        return;
+    }
+
+    file.open(name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if (file.fail())
+    {
+        std::cout << name << " could not be opened for editing. "
+                  << "Is it already open by another program or is it read-only?\n";
+        close();
+        return;
+    }
+
+    filename = name;
+    columns = width;
+    rows = height;
+    flip = bottom_up;
+
+    // Rows are padded so that they're always a multiple of 4 bytes.
+    const size_t row_bytes = bmpRowBytes(columns, 24);
+    row_data.assign(row_bytes, 0);
+
+    uchar_t headers[sizeof(bmpfile_magic) + sizeof(bmpfile_header)
+                    + sizeof(bmpfile_dib_info)];
+    const size_t offset = packHeaders(headers, columns, flip ? rows : -rows);
+    file.write((char*)(headers), offset);
+
+    file.seekp(offset + (uint64_t)row_bytes * rows - 1);
+    file.put(0);
+
+    if (!file)
+    {
+        std::cout << name << " could not be written. Is the disk full?\n";
+        close();
+    }
+}
+
+/**
+ * @brief Closes the file; rows that were never written remain black.
+**/
+void BitmapWriter::close()
+{
+    if (file.is_open())
+    {
+        file.close();
+    }
+    file.clear();
+    filename.clear();
+    columns = 0;
+    rows = 0;
+    flip = true;
+    row_data.clear();
+}
+
+/**
+ * @brief Writes a row of the image to its place in the file.
+ *
+ * The PackedPixels are already in the form the file stores, so they are only
+ * copied next to the row's padding before being written. Any errors will be
+ * echo'd to cout and write nothing.
+ *
+ * @param index of the row, where 0 is the top of the image
+ * @param the width() PackedPixels of the row
+ * @return whether the row was written
+**/
+bool BitmapWriter::writeRow(int y, const PackedPixel * source)
+{
+    if (!isOpen() || y < 0 || y >= rows)
+    {
+        return false;
+    }
+
+    std::memcpy(&row_data[0], source, columns * sizeof(PackedPixel));
+    return writeRowData(y);
+}
+
+/**
+ * @brief Writes a row of Pixels to its place in the file.
+ *
+ * Any errors, such as components outside of 0 to 255, will be echo'd to cout
+ * and write nothing.
+ *
+ * @param index of the row, where 0 is the top of the image
+ * @param the width() Pixels of the row
+ * @return whether the row was written
+**/
+bool BitmapWriter::writeRow(int y, const Pixel * source)
+{
+    if (!isOpen() || y < 0 || y >= rows)
+    {
+        return false;
+    }
+
+    if (!isPackableRow(source, columns))
+    {
+        std::cout << "Row " << y << " cannot be written to " << filename
+                  << ". It is not a valid row of an image.\n";
+        return false;
+    }
+
+    static const PackRowFunction packRow = selectPackRow();
+    packRow(source, reinterpret_cast <PackedPixel *> (&row_data[0]), columns);
+    return writeRowData(y);
+}
+
+/**
+ * @brief Writes the padded row held in row_data to the place of a row in the
+ * file.
+ *
+ * @param index of the row, where 0 is the top of the image
+ * @return whether the row was written
+**/
+bool BitmapWriter::writeRowData(int y)
+{
+    const size_t offset = sizeof(bmpfile_magic) + sizeof(bmpfile_header)
+            + sizeof(bmpfile_dib_info);
+    const int index = flip ? rows - 1 - y : y;
+
+    file.seekp(offset + (uint64_t)index * row_data.size());
+
+    if (!file.write((char*)(&row_data[0]), row_data.size()))
+    {
+        std::cout << filename << " could not be written. Is the disk full?\n";
+        file.clear();
+        return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * Maps a file into memory instead of reading it, so that its pixels can
+ * be inspected (or, when writable, changed) without copying the image.
+ * Any errors will cout and result in a MappedBitmap that is not open.
+ *
+ * @param name of the file to be mapped
+ * @param whether changes to the pixels should be written to the file
+ * @return the mapped file
+**/
+MappedBitmap Bitmap::openMapped(std::string filename, bool writable)
+{
+    MappedBitmap mapped;
+    mapped.open(filename, writable);
+    return mapped;
+}
+
+// ----------------------------------------------------------------------------
+/**
+ * @brief Describes a file from its headers as Bitmap::probe does, reporting
+ * any errors to the stream given.
+ *
+ * @param name of the file to be described
+ * @param where to report errors
+ * @return the description of the file, not valid if it could not be read
+ */
+static BitmapInfo probeFile(const std::string & filename, std::ostream & log)
+{
+    BitmapInfo info;
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+
+    if (file.fail())
+    {
+        log << filename << " could not be opened. Does it exist? "
+            << "Is it already open by another program?\n";
+        return info;
+    }
+
+    bmpfile_header header;
+    bmpfile_dib_info dib_info;
+    bmpfile_v5_info extra;
+
+    if (!readHeaders(file, filename, header, dib_info, &extra, log))
+    {
+        return info;
+    }
+
+    info.valid = true;
+    info.header_size = dib_info.header_size;
+    info.width = dib_info.width;
+    info.height = dib_info.height < 0 ? -dib_info.height : dib_info.height;
+    info.bits_per_pixel = dib_info.bits_per_pixel;
+    info.compression = dib_info.compression;
+    info.bottom_up = dib_info.height > 0;
+    info.pixel_offset = header.bmp_offset;
+
+    if (dib_info.header_size >= BMP_V4_HEADER_SIZE)
+    {
+        info.color_space = extra.cs_type;
+    }
+    if (dib_info.header_size >= BMP_V5_HEADER_SIZE && extra.cs_type == BMP_PROFILE_EMBEDDED)
+    {
+        // The offset of the profile counts from the start of the DIB header.
+        info.icc_offset = sizeof(bmpfile_magic) + sizeof(bmpfile_header)
+                + extra.profile_data;
+        info.icc_size = extra.profile_size;
+    }
+    return info;
+}
+
+/**
+ * @brief Joins every thread it holds when it goes out of scope, so that the
+ * threads already started are joined however the scope is left.
+ */
+struct ThreadJoiner
+{
+    std::vector <std::thread> threads;
+
+    ~ThreadJoiner()
+    {
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+    }
+};
+
+/**
+ * @brief Reads only the headers at the start of a file, as its name is
+ * provided, to describe the image without reading any of its pixels.
+ *
+ * Only the magic bytes, header and DIB information are parsed, which the
+ * stream fetches with a single read. Any errors will be echo'd to cout and
+ * result in a description that is not valid.
+ *
+ * @param name of the file to be described
+ * @return the size, bit depth, compression, orientation and pixel offset,
+ *         and the header version, color space and ICC profile
+**/
+BitmapInfo Bitmap::probe(std::string filename)
+{
+    return probeFile(filename, std::cout);
+}
+
+/**
+ * @brief Describes many files at once, probing several of them concurrently.
+ *
+ * Each worker thread repeatedly claims the next file that has not been
+ * probed yet, so slow files do not hold up the rest of the batch. The errors
+ * of each file are collected on the side and printed in the order of the
+ * names once every worker is done, rather than interleaved as they happen.
+ * A worker that cannot be started leaves its share to the others.
+ *
+ * @param names of the files to be described
+ * @param the most files to probe at the same time; 0 picks one per hardware
+ *        thread
+ * @return a description for each file, in the same order as the names
+**/
+std::vector <BitmapInfo> Bitmap::probe(const std::vector <std::string> & filenames,
+                                       int concurrency)
+{
+    std::vector <BitmapInfo> infos(filenames.size());
+    std::vector <std::string> messages(filenames.size());
+    std::atomic <size_t> next(0);
+
+    if (concurrency <= 0)
+    {
+        concurrency = std::max(1u, std::thread::hardware_concurrency());
+    }
+    concurrency = std::min <size_t> (concurrency, filenames.size());
+
+    auto work = [&]()
+    {
+        for (size_t i = next++; i < filenames.size(); i = next++)
+        {
+            std::ostringstream log;
+            infos[i] = probeFile(filenames[i], log);
+            messages[i] = log.str();
+        }
+    };
+
+    {
+        ThreadJoiner workers;
+        workers.threads.reserve(concurrency);
+        try
+        {
+            for (int i = 1; i < concurrency; i++)
+            {
+                workers.threads.emplace_back(work);
+            }
+        }
+        catch (const std::system_error &)
+        {
+        }
+        work();
+    }
+
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+        std::cout << messages[i];
+    }
+    return infos;
 }
@@ -1,7 +1,16 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
 #include <string>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+#include <type_traits>
 #include <vector>
 
 // ----------------------------------------------------------------------------
@@ -23,67 +32,1175 @@ public:
 	Pixel(int r, int g, int b) : red(r), green(g), blue(b) { }
 };
 
+// ----------------------------------------------------------------------------
+/**
+ * Compact storage for the color of a Pixel. Each component is a single byte,
+ * so values are always between 0 and 255, and the components are kept in the
+ * blue, green, red order of Windows BMP files. Bitmaps store their images as
+ * PackedPixels, in a quarter of the memory Pixels would take.
+**/
+class PackedPixel
+{
+public:
+	// Stores the individual color components, in the order BMP files use.
+	uint8_t blue, green, red;
+
+	// Initializes a PackedPixel with a default black color.
+	PackedPixel() : blue(0), green(0), red(0) { }
+
+	// Initializes a color PackedPixel with the specified RGB values.
+	PackedPixel(uint8_t r, uint8_t g, uint8_t b) : blue(b), green(g), red(r) { }
+
+	// Converts a Pixel, clamping each component to between 0 and 255.
+	explicit PackedPixel(const Pixel & p)
+		: blue(clamp(p.blue)), green(clamp(p.green)), red(clamp(p.red)) { }
+
+	// Provides the color as a Pixel, for code that works with int components.
+	operator Pixel() const { return Pixel(red, green, blue); }
+
+private:
+	static uint8_t clamp(int value)
+	{
+		return value < 0 ? 0 : value > 255 ? 255 : value;
+	}
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * The ways a Bitmap can store the color of its pixels. The letters give the
+ * order of the channels in memory and the number gives the size of each
+ * channel in bits; RGBF32 has a float per channel, from 0.0 to 1.0.
+**/
+enum class PixelFormat
+{
+    BGR8,       // The order of 24-bit BMP files; stored as PackedPixels.
+    RGB8,
+    BGRA8,
+    GRAY8,
+    GRAY16,
+    RGB16,
+    RGBF32,
+    RGBA16
+};
+
+/**
+ * Compile-time description of a PixelFormat: the type and number of its
+ * channels, which channel holds each color (a gray format holds all three in
+ * channel 0), which holds alpha (-1 for none), and the value of a channel at
+ * full intensity. The pixel_type is the type that one pixel is stored as.
+**/
+template <PixelFormat F> struct PixelFormatTraits;
+
+template <PixelFormat F> struct BasicPixel;
+
+#define BITMAP_PIXEL_FORMAT_TRAITS(F, T, N, R, G, B, A, MAX, PIXEL) \
+    template <> struct PixelFormatTraits <PixelFormat::F> \
+    { \
+        typedef T channel_type; \
+        typedef PIXEL pixel_type; \
+        static constexpr int channels = N; \
+        static constexpr int red = R; \
+        static constexpr int green = G; \
+        static constexpr int blue = B; \
+        static constexpr int alpha = A; \
+        static constexpr bool gray = N - (A >= 0) == 1; \
+        static constexpr T max() { return MAX; } \
+    }
+
+BITMAP_PIXEL_FORMAT_TRAITS(BGR8,   uint8_t,  3, 2, 1, 0, -1, 255,
+                           PackedPixel);
+BITMAP_PIXEL_FORMAT_TRAITS(RGB8,   uint8_t,  3, 0, 1, 2, -1, 255,
+                           BasicPixel <PixelFormat::RGB8>);
+BITMAP_PIXEL_FORMAT_TRAITS(BGRA8,  uint8_t,  4, 2, 1, 0,  3, 255,
+                           BasicPixel <PixelFormat::BGRA8>);
+BITMAP_PIXEL_FORMAT_TRAITS(GRAY8,  uint8_t,  1, 0, 0, 0, -1, 255,
+                           BasicPixel <PixelFormat::GRAY8>);
+BITMAP_PIXEL_FORMAT_TRAITS(GRAY16, uint16_t, 1, 0, 0, 0, -1, 65535,
+                           BasicPixel <PixelFormat::GRAY16>);
+BITMAP_PIXEL_FORMAT_TRAITS(RGB16,  uint16_t, 3, 0, 1, 2, -1, 65535,
+                           BasicPixel <PixelFormat::RGB16>);
+BITMAP_PIXEL_FORMAT_TRAITS(RGBF32, float,    3, 0, 1, 2, -1, 1.0f,
+                           BasicPixel <PixelFormat::RGBF32>);
+BITMAP_PIXEL_FORMAT_TRAITS(RGBA16, uint16_t, 4, 0, 1, 2,  3, 65535,
+                           BasicPixel <PixelFormat::RGBA16>);
+
+#undef BITMAP_PIXEL_FORMAT_TRAITS
+
+/**
+ * A single pixel stored in a given PixelFormat: its channels, in the order of
+ * the format. BGR8 pixels are PackedPixels instead, which name their channels.
+**/
+template <PixelFormat F>
+struct BasicPixel
+{
+    typename PixelFormatTraits <F>::channel_type channel[PixelFormatTraits <F>::channels];
+};
+
+/**
+ * How the channels of the pixels of an image are arranged in memory. Most
+ * images are INTERLEAVED, with all the channels of a pixel next to each other.
+ * A PLANAR image keeps each channel in a plane of its own, so that filters
+ * which work on one channel at a time read and write contiguous samples.
+**/
+enum class PixelLayout
+{
+    INTERLEAVED,
+    PLANAR
+};
+
+// Number of channels in a pixel of a PixelFormat.
+inline int pixelFormatChannels(PixelFormat format)
+{
+    switch (format)
+    {
+        case PixelFormat::BGR8:   return PixelFormatTraits <PixelFormat::BGR8>::channels;
+        case PixelFormat::RGB8:   return PixelFormatTraits <PixelFormat::RGB8>::channels;
+        case PixelFormat::BGRA8:  return PixelFormatTraits <PixelFormat::BGRA8>::channels;
+        case PixelFormat::GRAY8:  return PixelFormatTraits <PixelFormat::GRAY8>::channels;
+        case PixelFormat::GRAY16: return PixelFormatTraits <PixelFormat::GRAY16>::channels;
+        case PixelFormat::RGB16:  return PixelFormatTraits <PixelFormat::RGB16>::channels;
+        case PixelFormat::RGBA16: return PixelFormatTraits <PixelFormat::RGBA16>::channels;
+        case PixelFormat::RGBF32: return PixelFormatTraits <PixelFormat::RGBF32>::channels;
+    }
+    return 0;
+}
+
+// Number of bytes one pixel of a PixelFormat is stored in.
+inline size_t pixelFormatSize(PixelFormat format)
+{
+    switch (format)
+    {
+        case PixelFormat::BGR8:
+            return sizeof(PixelFormatTraits <PixelFormat::BGR8>::pixel_type);
+        case PixelFormat::RGB8:
+            return sizeof(PixelFormatTraits <PixelFormat::RGB8>::pixel_type);
+        case PixelFormat::BGRA8:
+            return sizeof(PixelFormatTraits <PixelFormat::BGRA8>::pixel_type);
+        case PixelFormat::GRAY8:
+            return sizeof(PixelFormatTraits <PixelFormat::GRAY8>::pixel_type);
+        case PixelFormat::GRAY16:
+            return sizeof(PixelFormatTraits <PixelFormat::GRAY16>::pixel_type);
+        case PixelFormat::RGB16:
+            return sizeof(PixelFormatTraits <PixelFormat::RGB16>::pixel_type);
+        case PixelFormat::RGBA16:
+            return sizeof(PixelFormatTraits <PixelFormat::RGBA16>::pixel_type);
+        case PixelFormat::RGBF32:
+            return sizeof(PixelFormatTraits <PixelFormat::RGBF32>::pixel_type);
+    }
+    return 0;
+}
+
+/**
+ * Converts a single channel value between the channel types of two formats,
+ * scaling it so that full intensity stays full intensity.
+**/
+template <typename To, typename From> inline To convertChannel(From);
+
+template <> inline uint8_t convertChannel <uint8_t> (uint8_t v) { return v; }
+template <> inline uint16_t convertChannel <uint16_t> (uint16_t v) { return v; }
+template <> inline float convertChannel <float> (float v) { return v; }
+template <> inline uint16_t convertChannel <uint16_t> (uint8_t v) { return v * 257; }
+template <> inline float convertChannel <float> (uint8_t v) { return v * (1.0f / 255); }
+template <> inline float convertChannel <float> (uint16_t v) { return v * (1.0f / 65535); }
+
+template <> inline uint8_t convertChannel <uint8_t> (uint16_t v)
+{
+    // Rounds v / 257 to the nearest integer.
+    return (v * 255u + 32895u) >> 16;
+}
+
+template <> inline uint8_t convertChannel <uint8_t> (float v)
+{
+    return v <= 0 ? 0 : v >= 1 ? 255 : (uint8_t)(v * 255 + 0.5f);
+}
+
+template <> inline uint16_t convertChannel <uint16_t> (float v)
+{
+    return v <= 0 ? 0 : v >= 1 ? 65535 : (uint16_t)(v * 65535 + 0.5f);
+}
+
+/**
+ * The luma of a color, by the ITU-R BT.601 weights. Integer weights that sum
+ * to 256 keep 8- and 16-bit channels exact in 32-bit arithmetic.
+**/
+inline uint8_t channelLuma(uint8_t r, uint8_t g, uint8_t b)
+{
+    return (77u * r + 150u * g + 29u * b + 128u) >> 8;
+}
+
+inline uint16_t channelLuma(uint16_t r, uint16_t g, uint16_t b)
+{
+    return (77u * r + 150u * g + 29u * b + 128u) >> 8;
+}
+
+inline float channelLuma(float r, float g, float b)
+{
+    return 0.299f * r + 0.587f * g + 0.114f * b;
+}
+
+/**
+ * Converts a row of pixels from one PixelFormat to another. Everything about
+ * both formats is known at compile time, so each pair of formats compiles to
+ * its own loop with the channel positions and scaling built in. Colors become
+ * gray by their luma (ITU-R BT.601 weights); gray becomes equal red, green and
+ * blue; and pixels without alpha become fully opaque.
+ *
+ * @param the pixels to convert
+ * @param where to store the converted pixels
+ * @param number of pixels in the row
+**/
+template <PixelFormat From, PixelFormat To>
+void convertRow(const typename PixelFormatTraits <From>::pixel_type * source,
+                typename PixelFormatTraits <To>::pixel_type * target, int count)
+{
+    typedef PixelFormatTraits <From> S;
+    typedef PixelFormatTraits <To> T;
+    typedef typename S::channel_type SourceChannel;
+    typedef typename T::channel_type TargetChannel;
+
+    const SourceChannel * in = reinterpret_cast <const SourceChannel *> (source);
+    TargetChannel * out = reinterpret_cast <TargetChannel *> (target);
+
+    for (int i = 0; i < count; i++, in += S::channels, out += T::channels)
+    {
+        if (T::gray && !S::gray)
+        {
+            SourceChannel luma = channelLuma(in[S::red], in[S::green], in[S::blue]);
+            out[0] = convertChannel <TargetChannel> (luma);
+        }
+        else
+        {
+            out[T::red] = convertChannel <TargetChannel> (in[S::red]);
+            out[T::green] = convertChannel <TargetChannel> (in[S::green]);
+            out[T::blue] = convertChannel <TargetChannel> (in[S::blue]);
+        }
+
+        if (T::alpha >= 0)
+        {
+            out[T::alpha < 0 ? 0 : T::alpha] = S::alpha >= 0
+                    ? convertChannel <TargetChannel> (in[S::alpha < 0 ? 0 : S::alpha])
+                    : T::max();
+        }
+    }
+}
+
+/**
+ * A window onto rows of pixels of one PixelFormat that are stored elsewhere,
+ * such as in a Bitmap. Rows start stride() bytes apart, which may be negative
+ * for rows stored bottom-up. An empty view has no rows and no columns. A
+ * ReadOnly view (a ConstPixelView) only hands out const pixels.
+**/
+template <PixelFormat F, bool ReadOnly = false>
+class PixelView
+{
+  public:
+    typedef typename std::conditional <ReadOnly,
+            const typename PixelFormatTraits <F>::pixel_type,
+            typename PixelFormatTraits <F>::pixel_type>::type pixel_type;
+
+  private:
+    typedef typename std::conditional <ReadOnly,
+            const unsigned char, unsigned char>::type byte_type;
+
+    byte_type * origin;
+    int columns;
+    int rows;
+    std::ptrdiff_t row_stride;
+
+  public:
+    PixelView() : origin(NULL), columns(0), rows(0), row_stride(0) { }
+
+    PixelView(typename std::conditional <ReadOnly, const void, void>::type * first_row,
+              int width, int height, std::ptrdiff_t stride)
+        : origin(static_cast <byte_type *> (first_row)), columns(width),
+          rows(height), row_stride(stride) { }
+
+    // A writable view can always be read through.
+    operator PixelView <F, true> () const
+    {
+        return PixelView <F, true> (origin, columns, rows, row_stride);
+    }
+
+    int width() const { return columns; }
+    int height() const { return rows; }
+    std::ptrdiff_t stride() const { return row_stride; }
+    bool empty() const { return columns == 0 || rows == 0; }
+
+    // Pointer to the first of the width() pixels of a row (0 is the top).
+    pixel_type * row(int y) const
+    {
+        return reinterpret_cast <pixel_type *> (origin + y * row_stride);
+    }
+
+    pixel_type & pixel(int y, int x) const { return row(y)[x]; }
+};
+
+template <PixelFormat F>
+using ConstPixelView = PixelView <F, true>;
+
+/**
+ * A window onto one channel of the pixels of an image, whichever PixelLayout
+ * the image uses. Sample x of a row is at row(y)[x * step()]: the step is 1
+ * for planar images, so per-channel loops walk contiguous memory and
+ * vectorize, and the number of channels for interleaved ones. A view of const
+ * samples, as a const Bitmap gives, only hands out const samples.
+**/
+template <typename T>
+class ChannelView
+{
+  private:
+    typedef typename std::conditional <std::is_const <T>::value,
+            const unsigned char, unsigned char>::type byte_type;
+
+    byte_type * origin;
+    int columns;
+    int rows;
+    std::ptrdiff_t row_stride;
+    int sample_step;
+
+  public:
+    ChannelView() : origin(NULL), columns(0), rows(0), row_stride(0), sample_step(0) { }
+
+    ChannelView(typename std::conditional <std::is_const <T>::value, const void, void>::type *
+                first_sample, int width, int height, std::ptrdiff_t stride, int step)
+        : origin(static_cast <byte_type *> (first_sample)), columns(width),
+          rows(height), row_stride(stride), sample_step(step) { }
+
+    int width() const { return columns; }
+    int height() const { return rows; }
+    std::ptrdiff_t stride() const { return row_stride; }
+    int step() const { return sample_step; }
+    bool empty() const { return columns == 0 || rows == 0; }
+
+    // Pointer to the first sample of a row (0 is the top).
+    T * row(int y) const
+    {
+        return reinterpret_cast <T *> (origin + y * row_stride);
+    }
+
+    T & sample(int y, int x) const { return row(y)[x * sample_step]; }
+};
+
 // ----------------------------------------------------------------------------
 //To abbreviate a pixel matrix built as a vector of vectors
 typedef std::vector < std::vector <Pixel> > PixelMatrix;
 
+// ----------------------------------------------------------------------------
+/**
+ * Contiguous storage for a rectangular grid of pixels of one PixelFormat,
+ * PackedPixels unless asked otherwise. Every row lives in one 64-byte aligned
+ * allocation and starts a fixed number of bytes (the stride) after the
+ * previous one, so each row begins on a cache line and walking the image from
+ * top to bottom touches linear memory. The allocation is reference counted
+ * and copied on write, so copying a buffer takes constant time.
+**/
+class PixelBuffer
+{
+  private:
+    std::shared_ptr <unsigned char> data;
+    unsigned char * origin;
+    int columns;
+    int rows;
+    std::ptrdiff_t row_stride;
+    PixelFormat pixel_format;
+    PixelLayout pixel_layout;
+
+    // Replaces the shared pixels with a private copy of them.
+    void clone();
+
+  public:
+    // Initializes an empty buffer with no rows and no columns.
+    PixelBuffer();
+
+    // Initializes a buffer of the specified width and height of black pixels.
+    PixelBuffer(int width, int height, PixelFormat format = PixelFormat::BGR8,
+                bool bottom_up = false, PixelLayout layout = PixelLayout::INTERLEAVED);
+
+    // Refers to interleaved pixels in memory the buffer does not own, given
+    // the first byte of the top row and the stride, without copying them.
+    // The buffer is empty if they do not form a proper image.
+    PixelBuffer(void * first_row, int width, int height, std::ptrdiff_t stride,
+                PixelFormat format);
+
+    // Copies share the pixels, without copying any, until one of them is
+    // written to.
+    PixelBuffer(const PixelBuffer &);
+    PixelBuffer & operator=(const PixelBuffer &);
+    ~PixelBuffer();
+
+    /**
+     * Whether other buffers share these pixels. use_count is a relaxed read,
+     * so finding the pixels unshared is followed by an acquire fence: every
+     * access other buffers made before letting go of them, perhaps on other
+     * threads, then comes before this buffer writes to them in place. As for
+     * any object, a buffer must not be copied on one thread while another
+     * writes to it.
+    **/
+    bool shared() const
+    {
+        if (!data)
+        {
+            return false;
+        }
+        if (data.use_count() > 1)
+        {
+            return true;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return false;
+    }
+
+    /**
+     * Gives the buffer a copy of its pixels of its own if it shares them,
+     * so that writing to it leaves the other buffers untouched. Every
+     * accessor that can write to the pixels does this first; pointers
+     * obtained before the buffer was copied still reach the shared pixels.
+    **/
+    void detach()
+    {
+        if (shared())
+        {
+            clone();
+        }
+    }
+
+    // Number of pixels in each row.
+    int width() const { return columns; }
+
+    // Number of rows.
+    int height() const { return rows; }
+
+    // Distance in bytes between the start of a row and the row below it.
+    // Negative when the rows are stored bottom-up in memory.
+    std::ptrdiff_t stride() const { return row_stride; }
+
+    // Whether the bottom row comes first in memory.
+    bool bottomUp() const { return row_stride < 0; }
+
+    // The format every pixel is stored in.
+    PixelFormat format() const { return pixel_format; }
+
+    // How the channels of the pixels are arranged.
+    PixelLayout layout() const { return pixel_layout; }
+
+    // Number of planes: one per channel for PLANAR buffers, otherwise one.
+    int planes() const
+    {
+        return pixel_layout == PixelLayout::PLANAR ? pixelFormatChannels(pixel_format) : 1;
+    }
+
+    // Whether the buffer holds no pixels at all.
+    bool empty() const { return columns == 0 || rows == 0; }
+
+    // Pointer to the first byte of a row (0 is the top), in any format. For
+    // PLANAR buffers this is the row of the first plane.
+    unsigned char * rowData(int y) { detach(); return origin + y * row_stride; }
+    const unsigned char * rowData(int y) const { return origin + y * row_stride; }
+
+    // Pointer to the first sample of a row of one plane of a PLANAR buffer.
+    // Planes follow each other, rows() rows apart.
+    unsigned char * planeData(int plane, int y)
+    {
+        detach();
+        return origin + (y + plane * rows) * row_stride;
+    }
+    const unsigned char * planeData(int plane, int y) const
+    {
+        return origin + (y + plane * rows) * row_stride;
+    }
+
+    // Pointer to the first of the width() PackedPixels of a row (0 is the
+    // top). Only meaningful when the format is BGR8.
+    PackedPixel * row(int y)
+    {
+        detach();
+        return reinterpret_cast <PackedPixel *> (origin + y * row_stride);
+    }
+    const PackedPixel * row(int y) const
+    {
+        return reinterpret_cast <const PackedPixel *> (origin + y * row_stride);
+    }
+
+    /**
+     * Discards the current contents and reallocates the buffer to hold the
+     * specified number of columns and rows, all initialized to black. The
+     * rows can be laid out bottom-up, the native order of most BMP files, so
+     * that reading such a file fills memory front to back. PLANAR buffers are
+     * always laid out top-down.
+     *
+     * @param width (columns) and height (rows) of the new buffer
+     * @param the format to store each pixel in
+     * @param whether the bottom row comes first in memory
+     * @param how the channels of the pixels are arranged
+    **/
+    void resize(int, int, PixelFormat = PixelFormat::BGR8, bool = false,
+                PixelLayout = PixelLayout::INTERLEAVED);
+
+    // Releases all storage, leaving an empty buffer.
+    void clear();
+
+    // Exchanges the contents of two buffers without copying any pixels.
+    void swap(PixelBuffer &);
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * The 16-bit pixels Bitmap::save can pack images into. RGB555 files are
+ * plain uncompressed files; RGB565 files describe their pixels with
+ * BI_BITFIELDS masks.
+**/
+enum class PackedFormat
+{
+    UNPACKED,               // As many bits per pixel as the image needs.
+    RGB555,                 // 5 bits each of red, green and blue.
+    RGB565                  // 5 bits of red and blue and 6 of green.
+};
+
+/**
+ * Choices about the kind of file Bitmap::save writes. The defaults write the
+ * most widely readable file that keeps the whole image.
+**/
+struct BitmapSaveOptions
+{
+    bool indexed;           // Save GRAY8 images, and images of at most 256
+                            // colors, with a color table at 1, 4 or 8 bits
+                            // per pixel, which only open and decode read.
+    bool rle8;              // Compress images saved with a color table with
+                            // RLE8, at 8 bits per pixel. Implies indexed.
+    PackedFormat packed;    // Pack every image into 16-bit pixels, losing
+                            // precision and any alpha.
+    bool dither;            // Dither 16-bit pixels with a 4x4 ordered pattern
+                            // instead of rounding each one.
+
+    BitmapSaveOptions()
+        : indexed(false), rle8(false), packed(PackedFormat::UNPACKED), dither(false) { }
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * Describes a Windows BMP file from its headers alone, as provided by
+ * Bitmap::probe. A file that could not be read or does not begin with BMP
+ * headers is described with valid set to false and every other field zero.
+**/
+struct BitmapInfo
+{
+    bool valid;             // Whether the file begins with BMP headers.
+    int width;              // Number of pixels in each row.
+    int height;             // Number of rows; always positive.
+    int bits_per_pixel;     // Bit depth, such as 1, 4, 8, 16, 24, or 32.
+    uint32_t compression;   // 0 for uncompressed images.
+    bool bottom_up;         // Whether the bottom row is stored first.
+    uint32_t pixel_offset;  // Offset from the start of the file to the pixels.
+    uint32_t header_size;   // Size of the DIB header: 12, 40, 52, 56, 64, 108 or 124.
+    uint32_t color_space;   // Color space of V4 and V5 headers, such as 'sRGB'.
+    uint32_t icc_offset;     // Offset from the start of the file to an embedded
+                            // ICC profile, or 0 if there is none.
+    uint32_t icc_size;       // Size of the embedded ICC profile.
+
+    BitmapInfo()
+        : valid(false), width(0), height(0), bits_per_pixel(0),
+          compression(0), bottom_up(false), pixel_offset(0), header_size(0),
+          color_space(0), icc_offset(0), icc_size(0) { }
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * A 24-bit Windows BMP file mapped into memory. The pixel array is used where
+ * it lies in the file, without copying or expanding it, as rows of
+ * PackedPixels. Rows are presented top-down whatever the order of the file;
+ * for bottom-up files the stride is negative.
+ *
+ * A read-only map never changes the file. Changes made through a writable map
+ * reach the file no later than the next call to sync() or close().
+**/
+class MappedBitmap
+{
+  private:
+    unsigned char * base;
+    size_t length;
+    bool writable;
+    unsigned char * origin;
+    int columns;
+    int rows;
+    std::ptrdiff_t row_stride;
+    std::string filename;
+
+    MappedBitmap(const MappedBitmap &);
+    MappedBitmap & operator=(const MappedBitmap &);
+
+  public:
+    // Initializes a MappedBitmap that is not attached to any file.
+    MappedBitmap();
+
+    MappedBitmap(MappedBitmap &&);
+    MappedBitmap & operator=(MappedBitmap &&);
+    ~MappedBitmap();
+
+    /**
+     * Maps a file as its name is provided and checks in place that it is an
+     * uncompressed 24-bit BMP whose pixel array lies within the file. Any
+     * errors will cout and leave the MappedBitmap closed.
+     *
+     * @param name of the file to be mapped
+     * @param whether changes to the pixels should be written to the file
+    **/
+    void open(std::string, bool = false);
+
+    /**
+     * Writes any changes made through a writable map back to the file and
+     * waits for them to complete. Does nothing for a read-only map.
+    **/
+    void sync();
+
+    // Writes back any changes, then unmaps the file.
+    void close();
+
+    // Whether a file is currently mapped.
+    bool isOpen() const { return base != NULL; }
+
+    // Whether changes to the pixels are written to the file.
+    bool isWritable() const { return writable; }
+
+    // Number of pixels in each row.
+    int width() const { return columns; }
+
+    // Number of rows.
+    int height() const { return rows; }
+
+    // Distance in bytes between the first pixels of a row and the row below
+    // it. Negative for files stored bottom-up.
+    std::ptrdiff_t stride() const { return row_stride; }
+
+    // Pointer to the width() PackedPixels of a row (0 is the top).
+    const PackedPixel * row(int y) const
+    {
+        return reinterpret_cast <const PackedPixel *> (origin + y * row_stride);
+    }
+
+    /**
+     * Provides a row that may be changed in place. Only available when the
+     * file was mapped writable.
+     *
+     * @param index of the row, where 0 is the top of the image
+     * @return pointer to the row's PackedPixels, or NULL for a read-only map
+    **/
+    PackedPixel * writableRow(int y)
+    {
+        return writable ? reinterpret_cast <PackedPixel *> (origin + y * row_stride) : NULL;
+    }
+
+    // Provides the color of a single pixel of the map.
+    const PackedPixel & pixel(int y, int x) const { return row(y)[x]; }
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * Reads a 24-bit Windows BMP file a band of rows at a time, so that images
+ * far larger than memory can be processed. The headers are read once when the
+ * file is opened; rows are then decoded on demand into a window of bounded
+ * size and always presented top-down, whichever way up the file is stored.
+**/
+class BitmapReader
+{
+  private:
+    std::ifstream file;
+    std::string filename;
+    int columns;
+    int rows;
+    bool flip;
+    uint32_t pixel_offset;
+    size_t window_bytes;
+    PixelBuffer window;
+    int window_first;
+
+  public:
+    // Initializes a BitmapReader that is not attached to any file.
+    BitmapReader();
+
+    /**
+     * Opens a file as its name is provided and reads its headers. No pixels
+     * are read until they are asked for. Any errors will cout and leave the
+     * BitmapReader closed.
+     *
+     * @param name of the file to be read
+     * @param the most memory, in bytes, to hold decoded rows in; at least one
+     *        row is always held
+    **/
+    void open(std::string, size_t = 16 << 20);
+
+    // Closes the file and releases the window.
+    void close();
+
+    // Whether a file is currently open.
+    bool isOpen() const { return file.is_open(); }
+
+    // Number of PackedPixels in each row.
+    int width() const { return columns; }
+
+    // Number of rows.
+    int height() const { return rows; }
+
+    /**
+     * Provides a row of the image, reading the band of rows that starts with
+     * it into the window if it is not held already. Reading the rows in order
+     * from the top therefore reads the file once, a window at a time.
+     *
+     * @param index of the row, where 0 is the top of the image
+     * @return pointer to the width() PackedPixels of the row, valid until the window
+     *         moves, or NULL if the row does not exist or cannot be read
+    **/
+    const PackedPixel * row(int);
+
+    /**
+     * Reads the band of rows that starts with a given row into the window.
+     *
+     * @param index of the first row of the band, where 0 is the top
+     * @return number of rows now held, from the given row down, or 0 if the
+     *         row does not exist or cannot be read
+    **/
+    int readBand(int);
+
+    // Rows currently held in the window; row 0 of the window is image row
+    // bandFirst().
+    const PixelBuffer & band() const { return window; }
+    int bandFirst() const { return window_first; }
+};
+
+// ----------------------------------------------------------------------------
+/**
+ * Writes a 24-bit Windows BMP file a row at a time, so that images far larger
+ * than memory can be produced. The size of the image is fixed when the file
+ * is opened and the headers are written straight away; each row is then
+ * written directly to its place in the file, in whatever order the rows are
+ * produced. Rows that are never written are left black.
+**/
+class BitmapWriter
+{
+  private:
+    std::ofstream file;
+    std::string filename;
+    int columns;
+    int rows;
+    bool flip;
+    std::vector <unsigned char> row_data;
+
+    bool writeRowData(int);
+
+  public:
+    // Initializes a BitmapWriter that is not attached to any file.
+    BitmapWriter();
+
+    /**
+     * Creates a file as its name is provided and writes the headers for an
+     * image of the given size. The file reserves the space for all of its
+     * rows up front; a top-down file is stored with a negative height.
+     * Any errors will cout and leave the BitmapWriter closed.
+     *
+     * @param name of the file to be written
+     * @param width and height of the image
+     * @param whether the rows are stored bottom-up, as most readers expect
+    **/
+    void open(std::string, int, int, bool = true);
+
+    // Closes the file; rows that were never written remain black.
+    void close();
+
+    // Whether a file is currently open.
+    bool isOpen() const { return file.is_open(); }
+
+    // Number of pixels in each row.
+    int width() const { return columns; }
+
+    // Number of rows.
+    int height() const { return rows; }
+
+    /**
+     * Writes a row of the image to its place in the file. Any errors will
+     * cout and write nothing.
+     *
+     * @param index of the row, where 0 is the top of the image
+     * @param the width() PackedPixels of the row
+     * @return whether the row was written
+    **/
+    bool writeRow(int, const PackedPixel *);
+
+    /**
+     * Writes a row of Pixels to its place in the file. Any errors, such as
+     * components outside of 0 to 255, will cout and write nothing.
+     *
+     * @param index of the row, where 0 is the top of the image
+     * @param the width() Pixels of the row
+     * @return whether the row was written
+    **/
+    bool writeRow(int, const Pixel *);
+};
+
 // ----------------------------------------------------------------------------
 /**
  * Represents a bitmap where a grid of pixels (in row-major order)
- * describes the color of each pixel within the image. Limited to Windows BMP
- * formatted images with no compression and 24 bit color depth.
+ * describes the color of each pixel within the image. Limited to
+ * Windows BMP formatted images of 1, 4 or 8 bits with a color table,
+ * uncompressed or RLE4/RLE8 compressed, 16 (RGB555), 24 or 32 bits, 16 or
+ * 32 bits with BI_BITFIELDS color masks, or 48 or 64 bits with 16 bits per
+ * channel.
 **/
 class Bitmap
 {
   private:
-    PixelMatrix pixels;
+    PixelBuffer pixels;
+
+    // Whether the rows are interleaved BGR8, the form of 24-bit BMP files.
+    bool isPackedRows() const
+    {
+        return pixels.format() == PixelFormat::BGR8 && pixels.layout() == PixelLayout::INTERLEAVED;
+    }
 
   public:
+    // Initializes an empty bitmap with no rows and no columns.
+    Bitmap() { }
+
+    // Initializes a black bitmap of the specified size, PixelFormat and
+    // PixelLayout.
+    Bitmap(int width, int height, PixelFormat format = PixelFormat::BGR8,
+           PixelLayout layout = PixelLayout::INTERLEAVED)
+        : pixels(width, height, format, false, layout) { }
+
+    /**
+     * Wraps interleaved pixels in memory the Bitmap does not own, such as a
+     * frame from a camera or another decoder, without copying them. The
+     * Bitmap can be saved, encoded and processed like any other. Writing to
+     * it writes to the memory in place, unless it has been copied, in which
+     * case the copy written to gets pixels of its own first; convert,
+     * setLayout and the other operations that change the format or size of
+     * the image move it to pixels of its own too. The memory must outlive the
+     * Bitmap and its copies. Any errors will cout but will result in an empty
+     * matrix (with no rows and no columns).
+     *
+     * @param pointer to the first byte of the top row
+     * @param width and height of the image in pixels
+     * @param distance in bytes from the start of a row to the row below it,
+     *        at least a row of pixels; negative for rows stored bottom-up
+     * @param the format of the pixels
+    **/
+    Bitmap(void *, int, int, std::ptrdiff_t, PixelFormat = PixelFormat::BGR8);
+
     /**
      * Opens a file as its name is provided and reads pixel-by-pixel the colors
      * into a matrix of RGB pixels. Any errors will cout but will result in an
      * empty matrix (with no rows and no columns).
      *
+     * 24-bit and indexed files are read as BGR8, as are RLE4 and RLE8
+     * compressed files. 32-bit files, and files whose color masks include
+     * alpha, are read as BGRA8 with their alpha kept; other 16-bit files,
+     * RGB555 and RGB565 among them, are read as BGR8. 48-bit files are read
+     * as RGB16 and 64-bit files as RGBA16, keeping all 16 bits of each
+     * channel. Any of the DIB headers, from the BITMAPCOREHEADER to the
+     * BITMAPV5HEADER, is understood.
+     *
      * @param name of the filename to be opened and read as a matrix of pixels
     **/
     void open(std::string);
 
+    /**
+     * Decodes a whole BMP file held in memory, such as one received over a
+     * network or read from an archive, as open would the same file. The
+     * bytes are only read, and need not outlive the call. Any errors will
+     * cout but will result in an empty matrix (with no rows and no columns).
+     *
+     * @param the bytes of the file
+     * @param number of bytes
+    **/
+    void decode(const void *, size_t);
+
+#ifdef __cpp_lib_span
+    // Decodes a whole BMP file held in memory, as decode(const void *, size_t).
+    void decode(std::span <const std::byte> data) { decode(data.data(), data.size()); }
+#endif
+
+    /**
+     * Opens a file as its name is provided and reads only the pixels of a
+     * rectangular region of it, which becomes the whole bitmap. The region is
+     * clipped to the image. Any errors will cout but will result in an empty
+     * matrix (with no rows and no columns).
+     *
+     * @param name of the filename to be opened
+     * @param column and row of the top-left corner of the region
+     * @param width and height of the region
+    **/
+    void openRegion(std::string, int, int, int, int);
+
     /**
      * Saves the current image, represented by the matrix of pixels, as a
      * Windows BMP file with the name provided by the parameter. File extension
      * is not forced but should be .bmp. Any errors will cout and will NOT 
      * attempt to save the file.
      *
+     * BGRA8 images are saved as 32-bit files with an alpha mask, which keeps
+     * their alpha. RGBA16 images are saved as 64-bit files, and RGB16 and
+     * GRAY16 images as 48-bit files, which keep all 16 bits of each channel.
+     * All others are saved as 24-bit files. The options can ask for GRAY8
+     * images, and images of at most 256 colors, to be saved as 1, 4 or 8-bit
+     * files with a color table, compressed with RLE8 unless it would not
+     * shrink them, or for any image to be packed into 16-bit RGB555 or RGB565
+     * pixels, rounded or dithered.
+     *
      * @param name of the filename to be written as a bmp image
+     * @param choices about the kind of file to write
+    **/
+    void save(std::string, const BitmapSaveOptions & = BitmapSaveOptions()) const;
+
+    /**
+     * Serializes the current image into memory as the complete BMP file save
+     * would write, headers and padded rows, into a buffer of the caller's.
+     * The exact size of the file is worked out first, and nothing is written
+     * unless the buffer can hold it all; pass a null buffer to learn the size.
+     * Any errors will cout.
+     *
+     * @param where to write the file
+     * @param number of bytes the buffer holds
+     * @param choices about the kind of file to write
+     * @return the size of the file, or 0 if the image is not valid
+    **/
+    size_t encode(void *, size_t, const BitmapSaveOptions & = BitmapSaveOptions()) const;
+
+    /**
+     * Serializes the current image into memory as the complete BMP file save
+     * would write, replacing the contents of a vector that grows to fit it.
+     * A vector reused for image after image keeps its capacity. Any errors
+     * will cout and leave the vector empty.
+     *
+     * @param the vector to fill with the file
+     * @param choices about the kind of file to write
     **/
-    void save(std::string);
+    void encode(std::vector <unsigned char> &,
+                const BitmapSaveOptions & = BitmapSaveOptions()) const;
 
     /**
      * Validates whether or not the current matrix of pixels represents a
      * proper image with non-zero-size rows and consistent non-zero-size
-     * columns for each row. In addition, each pixel in the matrix is validated
-     * to have red, green, and blue components with values between 0 and 255
+     * columns for each row. The components of every pixel are stored in a
+     * byte each, so they always have values between 0 and 255
+     *
+     * Every way of filling a Bitmap keeps it rectangular and in range, or
+     * leaves it empty, so this takes constant time and never looks at the
+     * pixels.
      *
      * @return boolean value of whether or not the matrix is a valid image
     **/
-    bool isImage();
+    bool isImage() const;
+
+    /**
+     * Scans a matrix of pixels from outside the Bitmap, such as one about to
+     * be passed to fromPixelMatrix, for whether it is a proper image: at
+     * least one row, every row the same non-zero size, and every component
+     * between 0 and 255.
+     *
+     * @param a matrix of pixels to check
+     * @return whether fromPixelMatrix would accept the matrix
+    **/
+    static bool validate(const PixelMatrix &);
 
     /**
      * Provides a vector of vector of pixels representing the bitmap
      *
      * @return the bitmap image, represented by a matrix of RGB pixels
     **/
-    PixelMatrix toPixelMatrix();
+    PixelMatrix toPixelMatrix() const;
+
+    /**
+     * Provides a vector of vector of pixels representing the bitmap and
+     * leaves the bitmap empty, releasing its own copy of the image. Use it
+     * instead of toPixelMatrix when the matrix is going to be edited and
+     * handed back with fromPixelMatrix.
+     *
+     * @return the bitmap image, represented by a matrix of RGB pixels
+    **/
+    PixelMatrix takePixelMatrix();
 
     /**
      * Overwrites the current bitmap with that represented by a matrix of
-     * pixels. Does not validate that the new matrix of pixels is a proper
-     * image.
+     * pixels. A matrix that is not rectangular, or that has a component
+     * outside of 0 to 255, is not a proper image and leaves the bitmap empty.
      *
      * @param a matrix of pixels to represent a bitmap
     **/
     void fromPixelMatrix(const PixelMatrix &);
-    
+
+    /**
+     * Overwrites the current bitmap with that represented by a matrix of
+     * pixels that is no longer needed. Each row of the matrix is released as
+     * soon as it has been stored, so the image is never held twice in full,
+     * and the matrix is left empty.
+     *
+     * @param a matrix of pixels to represent a bitmap
+    **/
+    void fromPixelMatrix(PixelMatrix &&);
+
+    /**
+     * Maps a file into memory instead of reading it, so that its pixels can
+     * be inspected (or, when writable, changed) without copying the image.
+     * Any errors will cout and result in a MappedBitmap that is not open.
+     *
+     * @param name of the file to be mapped
+     * @param whether changes to the pixels should be written to the file
+     * @return the mapped file
+    **/
+    static MappedBitmap openMapped(std::string, bool = false);
+
+    /**
+     * Reads only the headers at the start of a file, as its name is
+     * provided, to describe the image without reading any of its pixels.
+     * Any errors will cout and result in a description that is not valid.
+     *
+     * @param name of the file to be described
+     * @return the size, bit depth, compression, orientation and pixel offset
+    **/
+    static BitmapInfo probe(std::string);
+
+    /**
+     * Describes many files at once, probing several of them concurrently.
+     *
+     * @param names of the files to be described
+     * @param the most files to probe at the same time; 0 picks one per
+     *        hardware thread
+     * @return a description for each file, in the same order as the names
+    **/
+    static std::vector <BitmapInfo> probe(const std::vector <std::string> &, int = 0);
+
+    // Number of pixels in each row of the image.
+    int width() const { return pixels.width(); }
+
+    // Number of rows in the image.
+    int height() const { return pixels.height(); }
+
+    // The format the pixels of the image are stored in; BGR8 unless the image
+    // was created in or converted to another.
+    PixelFormat format() const { return pixels.format(); }
+
+    /**
+     * Converts every pixel of the image to another PixelFormat. The pair of
+     * formats is looked up once and the conversion then runs as a loop
+     * specialized at compile time for that pair.
+     *
+     * @param the format to store the pixels in from now on
+    **/
+    void convert(PixelFormat);
+
+    // How the channels of the pixels are arranged; INTERLEAVED unless the
+    // image was created or rearranged otherwise.
+    PixelLayout layout() const { return pixels.layout(); }
+
+    /**
+     * Rearranges the channels of every pixel of the image, splitting them
+     * into one plane per channel or merging the planes back into pixels.
+     *
+     * @param the layout to store the pixels in from now on
+    **/
+    void setLayout(PixelLayout);
+
+    /**
+     * Provides access to one channel of the image, stored in the PixelFormat
+     * given as the template argument, in either PixelLayout. The channel of
+     * a const Bitmap is read-only, and reading it never copies pixels shared
+     * with other Bitmaps.
+     *
+     * @param index of the channel, such as PixelFormatTraits <F>::red
+     * @return a view of the channel, or an empty view if the image is not
+     *         stored in that format
+    **/
+    template <PixelFormat F>
+    ChannelView <typename PixelFormatTraits <F>::channel_type> channel(int c)
+    {
+        typedef typename PixelFormatTraits <F>::channel_type T;
+
+        if (pixels.format() != F || pixels.empty())
+        {
+            return ChannelView <T> ();
+        }
+        if (pixels.layout() == PixelLayout::PLANAR)
+        {
+            return ChannelView <T> (pixels.planeData(c, 0), pixels.width(),
+                                    pixels.height(), pixels.stride(), 1);
+        }
+        return ChannelView <T> (pixels.rowData(0) + c * sizeof(T), pixels.width(),
+                                pixels.height(), pixels.stride(),
+                                PixelFormatTraits <F>::channels);
+    }
+    template <PixelFormat F>
+    ChannelView <const typename PixelFormatTraits <F>::channel_type> channel(int c) const
+    {
+        typedef const typename PixelFormatTraits <F>::channel_type T;
+
+        if (pixels.format() != F || pixels.empty())
+        {
+            return ChannelView <T> ();
+        }
+        if (pixels.layout() == PixelLayout::PLANAR)
+        {
+            return ChannelView <T> (pixels.planeData(c, 0), pixels.width(),
+                                    pixels.height(), pixels.stride(), 1);
+        }
+        return ChannelView <T> (pixels.rowData(0) + c * sizeof(T), pixels.width(),
+                                pixels.height(), pixels.stride(),
+                                PixelFormatTraits <F>::channels);
+    }
+
+    /**
+     * Provides typed access to the pixels of an INTERLEAVED image in the
+     * PixelFormat given as the template argument. The view of a const Bitmap
+     * is a ConstPixelView, for reading the pixels in place without copying.
+     *
+     * @return a view of the whole image, or an empty view if the image is not
+     *         stored in that format and layout
+    **/
+    template <PixelFormat F>
+    PixelView <F> view()
+    {
+        if (pixels.format() != F || pixels.layout() != PixelLayout::INTERLEAVED || pixels.empty())
+        {
+            return PixelView <F> ();
+        }
+        return PixelView <F> (pixels.rowData(0), pixels.width(),
+                              pixels.height(), pixels.stride());
+    }
+    template <PixelFormat F>
+    ConstPixelView <F> view() const
+    {
+        if (pixels.format() != F || pixels.layout() != PixelLayout::INTERLEAVED || pixels.empty())
+        {
+            return ConstPixelView <F> ();
+        }
+        return ConstPixelView <F> (pixels.rowData(0), pixels.width(),
+                                   pixels.height(), pixels.stride());
+    }
+
+    /**
+     * Provides direct access to a row of a BGR8 image, stored contiguously
+     * with the rest of the image. The row holds width() PackedPixels.
+     *
+     * @param index of the row, where 0 is the top of the image
+     * @return pointer to the leftmost PackedPixel of the row, or NULL if the
+     *         image is stored in another format or is PLANAR
+    **/
+    PackedPixel * row(int y)
+    {
+        return isPackedRows() ? pixels.row(y) : NULL;
+    }
+    const PackedPixel * row(int y) const
+    {
+        return isPackedRows() ? pixels.row(y) : NULL;
+    }
+
+    /**
+     * Provides direct access to a single pixel of an INTERLEAVED BGR8 image. A
+     * PackedPixel converts to and from a Pixel for code that works with int
+     * components.
+     *
+     * @param row and column of the pixel, where (0, 0) is the top-left
+     * @return reference to the PackedPixel
+    **/
+    PackedPixel & pixel(int y, int x) { return pixels.row(y)[x]; }
+    const PackedPixel & pixel(int y, int x) const { return pixels.row(y)[x]; }
 };
 
 #include "bitmap.cpp"
@@ -0,0 +1,137 @@
+#ifndef _BITMAP_TESTS_CHECK_H_
+#define _BITMAP_TESTS_CHECK_H_
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../bitmap.h"
+
+// ----------------------------------------------------------------------------
+// A minimal harness for the tests: CHECK reports every failed condition with
+// its line and keeps going, and each test's main returns checkResult().
+
+static int check_failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #condition << " failed\n"; \
+            check_failures++; \
+        } \
+    } while (0)
+
+inline int checkResult()
+{
+    if (check_failures != 0)
+    {
+        std::cerr << check_failures << " checks failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Sends what Bitmap prints to cout elsewhere while it is alive, so that tests
+ * that feed it broken files on purpose do not bury real failures.
+**/
+class QuietCout
+{
+  private:
+    std::ostringstream sink;
+    std::streambuf * saved;
+
+  public:
+    QuietCout() : saved(std::cout.rdbuf(sink.rdbuf())) { }
+    ~QuietCout() { std::cout.rdbuf(saved); }
+};
+
+// Reproducible bytes for test images, the same on every run.
+inline uint32_t nextRandom(uint32_t & state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// A BGR8 image of noise, or of only the given number of colors.
+inline Bitmap makeImage(int width, int height, uint32_t seed, int colors = 0)
+{
+    Bitmap image(width, height);
+    PixelView <PixelFormat::BGR8> pixels = image.view <PixelFormat::BGR8> ();
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint32_t value = colors == 0 ? nextRandom(seed)
+                    : (nextRandom(seed) % colors) * 0x9E3779u;
+            pixels.pixel(y, x).blue = (uint8_t)(value);
+            pixels.pixel(y, x).green = (uint8_t)(value >> 8);
+            pixels.pixel(y, x).red = (uint8_t)(value >> 16);
+        }
+    }
+    return image;
+}
+
+template <PixelFormat F>
+inline bool sameRows(const Bitmap & a, const Bitmap & b)
+{
+    const ConstPixelView <F> left = a.view <F> ();
+    const ConstPixelView <F> right = b.view <F> ();
+    const size_t bytes = left.width() * sizeof(typename PixelFormatTraits <F>::pixel_type);
+
+    for (int y = 0; y < left.height(); y++)
+    {
+        if (std::memcmp(left.row(y), right.row(y), bytes) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether two images hold the same format, size and bytes of pixels.
+inline bool samePixels(Bitmap a, Bitmap b)
+{
+    if (a.format() != b.format() || a.width() != b.width() || a.height() != b.height())
+    {
+        return false;
+    }
+
+    a.setLayout(PixelLayout::INTERLEAVED);
+    b.setLayout(PixelLayout::INTERLEAVED);
+    switch (a.format())
+    {
+        case PixelFormat::BGR8:   return sameRows <PixelFormat::BGR8> (a, b);
+        case PixelFormat::RGB8:   return sameRows <PixelFormat::RGB8> (a, b);
+        case PixelFormat::BGRA8:  return sameRows <PixelFormat::BGRA8> (a, b);
+        case PixelFormat::GRAY8:  return sameRows <PixelFormat::GRAY8> (a, b);
+        case PixelFormat::GRAY16: return sameRows <PixelFormat::GRAY16> (a, b);
+        case PixelFormat::RGB16:  return sameRows <PixelFormat::RGB16> (a, b);
+        case PixelFormat::RGBA16: return sameRows <PixelFormat::RGBA16> (a, b);
+        case PixelFormat::RGBF32: return sameRows <PixelFormat::RGBF32> (a, b);
+    }
+    return false;
+}
+
+// The bytes of a file, or none if it cannot be read.
+inline std::vector <unsigned char> readFile(const std::string & name)
+{
+    std::ifstream file(name.c_str(), std::ios::in | std::ios::binary);
+    return std::vector <unsigned char> ((std::istreambuf_iterator <char> (file)),
+                                        std::istreambuf_iterator <char> ());
+}
+
+inline void writeFile(const std::string & name, const std::vector <unsigned char> & bytes)
+{
+    std::ofstream file(name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write((const char *)(bytes.empty() ? NULL : &bytes[0]), bytes.size());
+}
+
+#endif
@@ -0,0 +1,311 @@
+#include "check.h"
+
+#include <cstdio>
+#include <cstdint>
+
+#if defined(__unix__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#include <sys/resource.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Feeds every way of reading a file headers put together by hand, whose
+// fields lie about the image, and checks that each one gives up cleanly: no
+// exception, no huge allocation and no read past the end of the data. Also
+// reads OS/2 2.x headers and probes a batch of good and bad files at once.
+
+static const char * const FILE_NAME = "header_test.bmp";
+
+static void put16(std::vector <unsigned char> & bytes, uint32_t value)
+{
+    bytes.push_back((unsigned char)(value));
+    bytes.push_back((unsigned char)(value >> 8));
+}
+
+static void put32(std::vector <unsigned char> & bytes, uint32_t value)
+{
+    put16(bytes, value & 0xFFFF);
+    put16(bytes, value >> 16);
+}
+
+/**
+ * Builds a file with a BITMAPINFOHEADER, or a larger header padded with
+ * zeros, followed by a number of zero bytes of pixels.
+ *
+ * @param width and height the header claims
+ * @param bits per pixel and compression the header claims
+ * @param number of bytes of pixels that actually follow
+ * @param size of the DIB header, at least 40
+**/
+static std::vector <unsigned char> makeFile(int32_t width, int32_t height, int bits_per_pixel,
+                                            uint32_t compression, size_t pixel_bytes,
+                                            uint32_t header_size = 40)
+{
+    std::vector <unsigned char> bytes;
+    const uint32_t offset = 14 + header_size;
+
+    bytes.push_back('B');
+    bytes.push_back('M');
+    put32(bytes, offset + pixel_bytes);
+    put32(bytes, 0);
+    put32(bytes, offset);
+
+    put32(bytes, header_size);
+    put32(bytes, width);
+    put32(bytes, height);
+    put16(bytes, 1);
+    put16(bytes, bits_per_pixel);
+    put32(bytes, compression);
+    put32(bytes, 0);
+    put32(bytes, 2835);
+    put32(bytes, 2835);
+    put32(bytes, 0);
+    put32(bytes, 0);
+    bytes.resize(offset + pixel_bytes, 0);
+    return bytes;
+}
+
+/**
+ * Reads a file with decode, open, openRegion, BitmapReader, MappedBitmap and
+ * probe, all of which must reject it.
+**/
+static void checkRejected(const std::vector <unsigned char> & file)
+{
+    QuietCout quiet;
+
+    try
+    {
+        // A copy of just the file, so that reading past it is caught by
+        // tools like AddressSanitizer.
+        const std::vector <unsigned char> data(file);
+        Bitmap decoded;
+        decoded.decode(&data[0], data.size());
+        CHECK(!decoded.isImage());
+
+        writeFile(FILE_NAME, file);
+
+        Bitmap opened;
+        opened.open(FILE_NAME);
+        CHECK(!opened.isImage());
+
+        Bitmap region;
+        region.openRegion(FILE_NAME, 0, 0, 4, 4);
+        CHECK(!region.isImage());
+
+        BitmapReader reader;
+        reader.open(FILE_NAME);
+        CHECK(!reader.isOpen());
+
+        MappedBitmap mapped = Bitmap::openMapped(FILE_NAME);
+        CHECK(mapped.width() == 0);
+
+        CHECK(!Bitmap::probe(FILE_NAME).valid);
+    }
+    catch (const std::exception & error)
+    {
+        std::cerr << "threw " << error.what() << "\n";
+        CHECK(false);
+    }
+}
+
+// Sizes that are not sizes at all, in a file with room for a few pixels.
+static void testDimensions()
+{
+    checkRejected(makeFile(-100, 10, 24, 0, 64));
+    checkRejected(makeFile(0, 10, 24, 0, 64));
+    checkRejected(makeFile(10, 0, 24, 0, 64));
+    checkRejected(makeFile(0x7FFFFFFF, 1, 24, 0, 64));
+    checkRejected(makeFile(1, 0x7FFFFFFF, 24, 0, 64));
+    checkRejected(makeFile(1, INT32_MIN, 24, 0, 64));
+    checkRejected(makeFile(0x7FFFFFFF, 0x7FFFFFFF, 32, 0, 64));
+}
+
+// Pixels that would start within the headers, in a file long enough for
+// them wherever they start.
+static void testOverlap()
+{
+    static const uint32_t offsets[] = { 0, 14, 53 };
+
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+    {
+        std::vector <unsigned char> file = makeFile(2, 2, 24, 0, 64);
+        for (int b = 0; b < 4; b++)
+        {
+            file[10 + b] = (unsigned char)(offsets[i] >> (b * 8));
+        }
+        checkRejected(file);
+    }
+}
+
+/**
+ * Reads a file whose headers are sound but whose pixels are cut short with
+ * decode and every way of opening a file, all of which must reject it.
+**/
+static void checkTruncated(const std::vector <unsigned char> & file)
+{
+    QuietCout quiet;
+
+    try
+    {
+        const std::vector <unsigned char> data(file);
+        Bitmap decoded;
+        decoded.decode(&data[0], data.size());
+        CHECK(!decoded.isImage());
+
+        writeFile(FILE_NAME, file);
+
+        Bitmap opened;
+        opened.open(FILE_NAME);
+        CHECK(!opened.isImage());
+
+        Bitmap region;
+        region.openRegion(FILE_NAME, 0, 0, 4, 4);
+        CHECK(!region.isImage());
+
+        // BitmapReader only reads a band at a time, so it finds the end of
+        // the file when it reaches it.
+        BitmapReader reader;
+        reader.open(FILE_NAME);
+        CHECK(!reader.isOpen() || reader.row(0) == NULL);
+
+        MappedBitmap mapped = Bitmap::openMapped(FILE_NAME);
+        CHECK(mapped.width() == 0);
+    }
+    catch (const std::exception & error)
+    {
+        std::cerr << "threw " << error.what() << "\n";
+        CHECK(false);
+    }
+}
+
+// Sizes of images far larger than the files that claim to hold them.
+static void testTruncated()
+{
+    checkTruncated(makeFile(100000, 100000, 24, 0, 0));
+    checkTruncated(makeFile(100000, -100000, 24, 0, 64));
+    // Nothing but the 54 bytes of headers.
+    checkTruncated(makeFile(20000, 20000, 24, 0, 0));
+    checkTruncated(makeFile(20000, 20000, 32, 0, 1000));
+    checkTruncated(makeFile(1 << 24, 1 << 24, 16, 0, 1000));
+
+    // RLE8 files, whose length says nothing of their size, patched to claim
+    // more pixels than there is memory for.
+    BitmapSaveOptions rle8;
+    rle8.rle8 = true;
+    std::vector <unsigned char> runs;
+    Bitmap(64, 64).encode(runs, rle8);
+    CHECK(runs[30] == 1);
+
+    static const int32_t sizes[][2] = {
+        { 1 << 24, 1 << 24 }, { 60000, 60000 }, { 60000, -60000 }, { 64, 1 << 24 }
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (int b = 0; b < 4; b++)
+        {
+            runs[18 + b] = (unsigned char)(sizes[i][0] >> (b * 8));
+            runs[22 + b] = (unsigned char)(sizes[i][1] >> (b * 8));
+        }
+        checkTruncated(runs);
+    }
+}
+
+// OS/2 2.x headers are 64 bytes, with fields of their own where larger
+// Windows headers keep their masks, and compression values of their own.
+static void testOs2()
+{
+    // Huffman and RLE24, which Windows headers number BI_BITFIELDS and BI_JPEG.
+    std::vector <unsigned char> huffman = makeFile(5, 3, 16, 3, 64, 64);
+    static const uint32_t masks[] = { 0x7C00, 0x03E0, 0x001F };
+    for (int i = 0; i < 12; i++)
+    {
+        huffman[54 + i] = (unsigned char)(masks[i / 4] >> (i % 4 * 8));
+    }
+    checkRejected(huffman);
+    checkRejected(makeFile(5, 3, 24, 4, 64, 64));
+
+    // Uncompressed pixels read just as they would after a BITMAPINFOHEADER,
+    // whatever the OS/2 fields hold.
+    std::vector <unsigned char> os2 = makeFile(5, 3, 24, 0, 48, 64);
+    std::vector <unsigned char> windows = makeFile(5, 3, 24, 0, 48);
+    std::fill(os2.begin() + 54, os2.begin() + 78, 0xFF);
+    for (int i = 0; i < 48; i++)
+    {
+        os2[78 + i] = windows[54 + i] = (unsigned char)(i * 37);
+    }
+
+    QuietCout quiet;
+    Bitmap expected;
+    expected.decode(&windows[0], windows.size());
+    Bitmap decoded;
+    decoded.decode(&os2[0], os2.size());
+    CHECK(decoded.isImage() && samePixels(decoded, expected));
+
+    writeFile(FILE_NAME, os2);
+    Bitmap opened;
+    opened.open(FILE_NAME);
+    CHECK(opened.isImage() && samePixels(opened, expected));
+    const BitmapInfo info = Bitmap::probe(FILE_NAME);
+    CHECK(info.valid && info.header_size == 64);
+}
+
+// The batched probe describes each file as probe does, and prints the errors
+// of the files in the order of their names, each message whole.
+static void testProbeBatch()
+{
+    std::vector <std::string> names;
+    for (int i = 0; i < 24; i++)
+    {
+        std::ostringstream name;
+        name << "header_test_" << i << ".bmp";
+        names.push_back(name.str());
+
+        // Every third file is missing, and every third one is not a BMP.
+        if (i % 3 == 1)
+        {
+            writeFile(names.back(), makeFile(5 + i, 7, 24, 0, 1000));
+        }
+        else if (i % 3 == 2)
+        {
+            writeFile(names.back(), std::vector <unsigned char> (60, 'x'));
+        }
+    }
+
+    std::ostringstream printed;
+    std::streambuf * saved = std::cout.rdbuf(printed.rdbuf());
+    const std::vector <BitmapInfo> infos = Bitmap::probe(names, 8);
+    std::cout.rdbuf(saved);
+
+    std::ostringstream expected;
+    saved = std::cout.rdbuf(expected.rdbuf());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        const BitmapInfo info = Bitmap::probe(names[i]);
+        CHECK(infos[i].valid == info.valid && infos[i].width == info.width);
+        CHECK(info.valid == (i % 3 == 1));
+    }
+    std::cout.rdbuf(saved);
+    CHECK(printed.str() == expected.str());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        std::remove(names[i].c_str());
+    }
+}
+
+int main()
+{
+#if defined(__unix__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    // Turn an allocation sized from the headers into a failure even on
+    // machines with the memory to satisfy it.
+    const struct rlimit limit = { 512 << 20, 512 << 20 };
+    setrlimit(RLIMIT_AS, &limit);
+#endif
+
+    testDimensions();
+    testOverlap();
+    testTruncated();
+    testOs2();
+    testProbeBatch();
+    std::remove(FILE_NAME);
+    return checkResult();
+}
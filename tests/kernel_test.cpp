@@ -0,0 +1,305 @@
+#include "check.h"
+
+// ----------------------------------------------------------------------------
+// Checks that every row kernel picked at run time gives exactly the bytes of
+// its portable ...Scalar version, for every row width up to a few vectors
+// and from unaligned addresses. bitmap.cpp is part of bitmap.h, so its file
+// scope kernels can be called directly. Built with BITMAP_NO_SIMD, the
+// kernels picked are the scalar ones and every comparison is trivially true.
+
+static const int MAX_WIDTH = 70;
+
+// Random bytes, which are random pixels of any 8- or 16-bit format.
+static std::vector <unsigned char> randomBytes(size_t size, uint32_t seed)
+{
+    std::vector <unsigned char> bytes(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        bytes[i] = (unsigned char)(nextRandom(seed));
+    }
+    return bytes;
+}
+
+static void testExpandAndPack()
+{
+    const ExpandRowFunction expandRow = selectExpandRow();
+    const PackRowFunction packRow = selectPackRow();
+
+    for (int width = 0; width <= MAX_WIDTH; width++)
+    {
+        const std::vector <unsigned char> bytes = randomBytes(width * 3 + 1, width);
+        const PackedPixel * packed = (const PackedPixel *)(&bytes[1]);
+
+        std::vector <Pixel> expected(width + 1);
+        std::vector <Pixel> actual(width + 1);
+        expandRowScalar(packed, &expected[0], width);
+        expandRow(packed, &actual[0], width);
+        CHECK(std::memcmp(&expected[0], &actual[0], (width + 1) * sizeof(Pixel)) == 0);
+
+        std::vector <unsigned char> repacked(width * 3 + 1);
+        std::vector <unsigned char> scalar(width * 3 + 1);
+        packRowScalar(&expected[0], (PackedPixel *)(&scalar[1]), width);
+        packRow(&expected[0], (PackedPixel *)(&repacked[1]), width);
+        CHECK(repacked == scalar);
+        CHECK(std::equal(bytes.begin() + 1, bytes.end(), repacked.begin() + 1));
+    }
+}
+
+static void testPackable()
+{
+    std::vector <PackableRowFunction> kernels(1, selectPackableRow());
+#ifdef BITMAP_SIMD_X86
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        kernels.push_back(isPackableRowSse41);
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back(isPackableRowAvx2);
+    }
+#endif
+    static const int outside[] = { -1, 256, 1 << 20, -(1 << 30) };
+
+    for (int width = 1; width <= MAX_WIDTH; width++)
+    {
+        std::vector <Pixel> row(width, Pixel(255, 0, 128));
+        for (size_t k = 0; k < kernels.size(); k++)
+        {
+            CHECK(kernels[k](&row[0], width));
+        }
+
+        // A value out of range in any channel of any column is caught.
+        for (int col = 0; col < width; col++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                int & channel = c == 0 ? row[col].red : c == 1 ? row[col].green : row[col].blue;
+                const int saved = channel;
+                channel = outside[(col + c) % 4];
+                for (size_t k = 0; k < kernels.size(); k++)
+                {
+                    CHECK(!kernels[k](&row[0], width));
+                }
+                channel = saved;
+            }
+        }
+    }
+}
+
+// The compiled conversion between two formats, never a vector kernel.
+static ConvertRowFunction scalarConvertRow(PixelFormat from, PixelFormat to)
+{
+    switch (from)
+    {
+        case PixelFormat::BGR8:   return selectConvertRowFrom <PixelFormat::BGR8> (to);
+        case PixelFormat::RGB8:   return selectConvertRowFrom <PixelFormat::RGB8> (to);
+        case PixelFormat::BGRA8:  return selectConvertRowFrom <PixelFormat::BGRA8> (to);
+        case PixelFormat::GRAY8:  return selectConvertRowFrom <PixelFormat::GRAY8> (to);
+        case PixelFormat::GRAY16: return selectConvertRowFrom <PixelFormat::GRAY16> (to);
+        case PixelFormat::RGB16:  return selectConvertRowFrom <PixelFormat::RGB16> (to);
+        case PixelFormat::RGBA16: return selectConvertRowFrom <PixelFormat::RGBA16> (to);
+        case PixelFormat::RGBF32: return selectConvertRowFrom <PixelFormat::RGBF32> (to);
+    }
+    return NULL;
+}
+
+static void testConvert()
+{
+    // Floats are left out: random bytes are not the colors they hold.
+    static const PixelFormat formats[] = {
+        PixelFormat::BGR8, PixelFormat::RGB8, PixelFormat::BGRA8, PixelFormat::GRAY8,
+        PixelFormat::GRAY16, PixelFormat::RGB16, PixelFormat::RGBA16
+    };
+    const size_t count = sizeof(formats) / sizeof(formats[0]);
+
+    for (size_t f = 0; f < count; f++)
+    {
+        for (size_t t = 0; t < count; t++)
+        {
+            const ConvertRowFunction convertRow = selectConvertRow(formats[f], formats[t]);
+            const ConvertRowFunction scalar = scalarConvertRow(formats[f], formats[t]);
+            const size_t from_size = pixelFormatSize(formats[f]);
+            const size_t to_size = pixelFormatSize(formats[t]);
+
+            for (int width = 0; width <= MAX_WIDTH; width++)
+            {
+                // Channels stay aligned to their size, as in any PixelBuffer.
+                const std::vector <unsigned char> source =
+                        randomBytes(width * from_size + 2, width * 31 + f);
+                std::vector <unsigned char> expected(width * to_size + 2);
+                std::vector <unsigned char> actual(width * to_size + 2);
+
+                scalar(&source[2], &expected[2], width);
+                convertRow(&source[2], &actual[2], width);
+                CHECK(actual == expected);
+            }
+        }
+    }
+}
+
+template <typename T, int N>
+static void testSplitAndMerge(PixelFormat format)
+{
+    const SplitRowFunction splitRow = selectSplitRow(format);
+    const MergeRowFunction mergeRow = selectMergeRow(format);
+
+    for (int width = 0; width <= MAX_WIDTH; width++)
+    {
+        const std::vector <unsigned char> source =
+                randomBytes(width * N * sizeof(T) + 1, width * 7 + N);
+        std::vector <unsigned char> expected[N];
+        std::vector <unsigned char> actual[N];
+        unsigned char * expected_planes[N];
+        unsigned char * actual_planes[N];
+
+        for (int c = 0; c < N; c++)
+        {
+            expected[c].assign(width * sizeof(T) + 1, 0);
+            actual[c].assign(width * sizeof(T) + 1, 0);
+            expected_planes[c] = &expected[c][1];
+            actual_planes[c] = &actual[c][1];
+        }
+
+        splitRowScalar <T, N> (&source[1], expected_planes, width);
+        splitRow(&source[1], actual_planes, width);
+        for (int c = 0; c < N; c++)
+        {
+            CHECK(actual[c] == expected[c]);
+        }
+
+        std::vector <unsigned char> merged(source.size(), 0);
+        mergeRow(actual_planes, &merged[1], width);
+        CHECK(std::equal(source.begin() + 1, source.end(), merged.begin() + 1));
+    }
+}
+
+template <typename T>
+static void testBitfields(const uint32_t masks[4], int bits_per_pixel)
+{
+    RowDecoder decoder;
+    CHECK(selectBitfieldsDecoder(masks, bits_per_pixel, decoder));
+    if (decoder.decodeRow == NULL)
+    {
+        // Read in place, with nothing to compare.
+        return;
+    }
+
+    const size_t size = pixelFormatSize(decoder.format);
+    for (int width = 0; width <= MAX_WIDTH; width++)
+    {
+        const std::vector <unsigned char> source =
+                randomBytes(width * sizeof(T) + 1, width + masks[0]);
+        std::vector <unsigned char> expected(width * size + 1);
+        std::vector <unsigned char> actual(width * size + 1);
+
+        decodeBitfieldsScalar <T> (decoder, &source[1], &expected[1], width);
+        decoder.decodeRow(decoder, &source[1], &actual[1], width);
+        CHECK(actual == expected);
+    }
+}
+
+static void testAllBitfields()
+{
+    static const uint32_t masks16[][4] = {
+        { 0x7C00, 0x03E0, 0x001F, 0 },          // RGB555
+        { 0xF800, 0x07E0, 0x001F, 0 },          // RGB565
+        { 0x7C00, 0x03E0, 0x001F, 0x8000 },     // ARGB1555
+        { 0x0F00, 0x00F0, 0x000F, 0xF000 },     // ARGB4444
+        { 0x001F, 0x07E0, 0xF800, 0 },          // BGR565
+        { 0xE000, 0x1C00, 0x0300, 0x00FF }      // 3-3-2 and 8 bits of alpha
+    };
+    static const uint32_t masks32[][4] = {
+        { 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 },     // BGRA, in place
+        { 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 },     // RGBA
+        { 0xFF000000, 0x00FF0000, 0x0000FF00, 0 },              // XBGR
+        { 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }      // 10-10-10-2
+    };
+
+    for (size_t m = 0; m < sizeof(masks16) / sizeof(masks16[0]); m++)
+    {
+        testBitfields <uint16_t> (masks16[m], 16);
+    }
+    for (size_t m = 0; m < sizeof(masks32) / sizeof(masks32[0]); m++)
+    {
+        testBitfields <uint32_t> (masks32[m], 32);
+    }
+}
+
+template <int N>
+static void testSwapRedBlue16()
+{
+    const SwapRowFunction swapRow = selectSwapRedBlue16 <N> ();
+
+    for (int width = 0; width <= MAX_WIDTH; width++)
+    {
+        const std::vector <unsigned char> source = randomBytes(width * N * 2 + 2, width);
+        std::vector <unsigned char> expected(source.size());
+        std::vector <unsigned char> actual(source.size());
+
+        swapRedBlue16Scalar <N> (&source[2], &expected[2], width);
+        swapRow(&source[2], &actual[2], width);
+        CHECK(actual == expected);
+    }
+}
+
+static void testLookup()
+{
+    const LookupRowFunction lookupRow = selectLookupRow();
+    uint32_t palette[256];
+    uint32_t seed = 1;
+    for (int i = 0; i < 256; i++)
+    {
+        palette[i] = nextRandom(seed) & 0x00FFFFFF;
+    }
+
+    for (int width = 0; width <= MAX_WIDTH; width++)
+    {
+        const std::vector <unsigned char> indices = randomBytes(width + 1, width);
+        std::vector <unsigned char> expected(width * 3 + 1);
+        std::vector <unsigned char> actual(width * 3 + 1);
+
+        lookupRowScalar(palette, &indices[1], &expected[1], width);
+        lookupRow(palette, &indices[1], &actual[1], width);
+        CHECK(actual == expected);
+    }
+}
+
+static void testPackRgb16()
+{
+    const Pack16RowFunction pack16Row = selectPackRgb16Row();
+
+    for (int green_bits = 5; green_bits <= 6; green_bits++)
+    {
+        for (int offsets = 0; offsets < 5; offsets++)
+        {
+            const uint16_t * offset = offsets == 4 ? ROUND_OFFSETS : DITHER_OFFSETS[offsets];
+
+            for (int width = 0; width <= MAX_WIDTH; width++)
+            {
+                const std::vector <unsigned char> source = randomBytes(width * 3 + 1, width);
+                std::vector <unsigned char> expected(width * 2 + 1);
+                std::vector <unsigned char> actual(width * 2 + 1);
+
+                packRgb16RowScalar(&source[1], &expected[1], width, green_bits, offset);
+                pack16Row(&source[1], &actual[1], width, green_bits, offset);
+                CHECK(actual == expected);
+            }
+        }
+    }
+}
+
+int main()
+{
+    testExpandAndPack();
+    testPackable();
+    testConvert();
+    testSplitAndMerge <uint8_t, 3> (PixelFormat::BGR8);
+    testSplitAndMerge <uint8_t, 3> (PixelFormat::RGB8);
+    testSplitAndMerge <uint8_t, 4> (PixelFormat::BGRA8);
+    testAllBitfields();
+    testSwapRedBlue16 <3> ();
+    testSwapRedBlue16 <4> ();
+    testLookup();
+    testPackRgb16();
+    return checkResult();
+}
@@ -0,0 +1,422 @@
+#include "check.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+
+// ----------------------------------------------------------------------------
+// Saves images of every format, layout and kind of file, reads them back with
+// open and decode, and checks that encode produces the bytes save writes.
+
+static const char * const FILE_NAME = "roundtrip_test.bmp";
+
+/**
+ * Saves an image with the options given and checks that both forms of encode
+ * give exactly the bytes of the file.
+ *
+ * @return the bytes of the file
+**/
+static std::vector <unsigned char> saveAndEncode(const Bitmap & image,
+                                                 const BitmapSaveOptions & options)
+{
+    image.save(FILE_NAME, options);
+    const std::vector <unsigned char> saved = readFile(FILE_NAME);
+    CHECK(!saved.empty());
+
+    std::vector <unsigned char> encoded;
+    image.encode(encoded, options);
+    CHECK(encoded == saved);
+
+    CHECK(image.encode(NULL, 0, options) == saved.size());
+    std::vector <unsigned char> buffer(saved.size() + 16, 0xAB);
+    CHECK(image.encode(&buffer[0], saved.size() - 1, options) == saved.size());
+    CHECK(buffer[0] == 0xAB);
+    CHECK(image.encode(&buffer[0], buffer.size(), options) == saved.size());
+    CHECK(std::equal(saved.begin(), saved.end(), buffer.begin()));
+    CHECK(buffer[saved.size()] == 0xAB);
+    return saved;
+}
+
+// Reads a file back with open and with decode, which have to agree.
+static Bitmap readBack(const std::vector <unsigned char> & bytes)
+{
+    Bitmap opened;
+    opened.open(FILE_NAME);
+
+    Bitmap decoded;
+    decoded.decode(&bytes[0], bytes.size());
+    CHECK(samePixels(opened, decoded));
+    return opened;
+}
+
+// Every format survives a round trip, exactly where the file keeps it.
+static void testFormats()
+{
+    static const PixelFormat formats[] = {
+        PixelFormat::BGR8, PixelFormat::RGB8, PixelFormat::BGRA8, PixelFormat::GRAY8,
+        PixelFormat::GRAY16, PixelFormat::RGB16, PixelFormat::RGBF32, PixelFormat::RGBA16
+    };
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        for (int planar = 0; planar < 2; planar++)
+        {
+            // Odd widths give rows that need padding in every kind of file.
+            Bitmap image = makeImage(37, 23, 7 + f);
+            image.convert(formats[f]);
+            image.setLayout(planar ? PixelLayout::PLANAR : PixelLayout::INTERLEAVED);
+
+            const Bitmap back = readBack(saveAndEncode(image, BitmapSaveOptions()));
+
+            // Files keep alpha and 16-bit channels; the rest is 8-bit color.
+            Bitmap expected = image;
+            if (formats[f] == PixelFormat::GRAY16)
+            {
+                expected.convert(PixelFormat::RGB16);
+            }
+            else if (formats[f] != PixelFormat::BGRA8 && formats[f] != PixelFormat::RGB16
+                    && formats[f] != PixelFormat::RGBA16)
+            {
+                expected.convert(PixelFormat::BGR8);
+            }
+            expected.setLayout(PixelLayout::INTERLEAVED);
+            CHECK(samePixels(back, expected));
+        }
+    }
+}
+
+// Images of few colors come back exactly from indexed and RLE8 files.
+static void testIndexed()
+{
+    static const int colors[] = { 2, 16, 200 };
+
+    for (size_t c = 0; c < sizeof(colors) / sizeof(colors[0]); c++)
+    {
+        const Bitmap image = makeImage(41, 19, 3, colors[c]);
+
+        BitmapSaveOptions options;
+        options.indexed = true;
+        CHECK(samePixels(readBack(saveAndEncode(image, options)), image));
+
+        options.rle8 = true;
+        CHECK(samePixels(readBack(saveAndEncode(image, options)), image));
+    }
+}
+
+// Images saved without options are 24-bit files, whatever their colors, so
+// that openRegion, BitmapReader and MappedBitmap read them too.
+static void testDefaultReaders()
+{
+    Bitmap gray = makeImage(23, 9, 19);
+    gray.convert(PixelFormat::GRAY8);
+    Bitmap images[2] = { makeImage(23, 9, 19, 4), gray };
+
+    for (int i = 0; i < 2; i++)
+    {
+        Bitmap expected = images[i];
+        expected.convert(PixelFormat::BGR8);
+
+        const std::vector <unsigned char> file = saveAndEncode(images[i], BitmapSaveOptions());
+        CHECK(file[28] == 24);
+        CHECK(samePixels(readBack(file), expected));
+
+        Bitmap region;
+        region.openRegion(FILE_NAME, 0, 0, expected.width(), expected.height());
+        CHECK(samePixels(region, expected));
+
+        BitmapReader reader;
+        reader.open(FILE_NAME);
+        MappedBitmap mapped = Bitmap::openMapped(FILE_NAME);
+        CHECK(reader.isOpen() && mapped.width() == expected.width());
+        const size_t row_size = expected.width() * sizeof(PackedPixel);
+        for (int y = 0; y < expected.height() && reader.isOpen(); y++)
+        {
+            const PackedPixel * row = reader.row(y);
+            CHECK(row != NULL && std::memcmp(row, &expected.pixel(y, 0), row_size) == 0);
+            CHECK(std::memcmp(&mapped.pixel(y, 0), &expected.pixel(y, 0), row_size) == 0);
+        }
+    }
+}
+
+// BitmapReader gives every row of a bottom-up file whatever its window, from
+// one row up to one far larger than memory, in order and across bands.
+static void testReaderWindows()
+{
+    const Bitmap image = makeImage(19, 14, 23);
+    const std::vector <unsigned char> file = saveAndEncode(image, BitmapSaveOptions());
+    CHECK(file[25] < 0x80);
+
+    const size_t row_size = image.width() * sizeof(PackedPixel);
+    const size_t windows[] = {
+        1, 3 * row_size, 5 * row_size + 1, (size_t)(UINT32_MAX) * row_size, SIZE_MAX
+    };
+    static const int order[] = { 0, 13, 4, 5, 3, 12, 6, 1 };
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+    {
+        BitmapReader reader;
+        reader.open(FILE_NAME, windows[w]);
+        CHECK(reader.isOpen() && reader.height() == image.height());
+
+        for (int y = 0; y < image.height() && reader.isOpen(); y++)
+        {
+            const PackedPixel * row = reader.row(y);
+            CHECK(row != NULL && std::memcmp(row, &image.pixel(y, 0), row_size) == 0);
+        }
+        for (size_t i = 0; i < sizeof(order) / sizeof(order[0]) && reader.isOpen(); i++)
+        {
+            const PackedPixel * row = reader.row(order[i]);
+            CHECK(row != NULL && std::memcmp(row, &image.pixel(order[i], 0), row_size) == 0);
+        }
+        CHECK(reader.row(image.height()) == NULL);
+    }
+}
+
+// Copies the rows of an interleaved image into memory laid out with a stride.
+template <PixelFormat F>
+static void copyRows(const Bitmap & image, unsigned char * first_row, std::ptrdiff_t stride)
+{
+    const ConstPixelView <F> pixels = image.view <F> ();
+    const size_t bytes = pixels.width() * sizeof(typename PixelFormatTraits <F>::pixel_type);
+
+    for (int y = 0; y < pixels.height(); y++)
+    {
+        std::memcpy(first_row + y * stride, pixels.row(y), bytes);
+    }
+}
+
+static void copyRows(const Bitmap & image, unsigned char * first_row, std::ptrdiff_t stride)
+{
+    switch (image.format())
+    {
+        case PixelFormat::BGR8:   copyRows <PixelFormat::BGR8> (image, first_row, stride); break;
+        case PixelFormat::RGB8:   copyRows <PixelFormat::RGB8> (image, first_row, stride); break;
+        case PixelFormat::BGRA8:  copyRows <PixelFormat::BGRA8> (image, first_row, stride); break;
+        case PixelFormat::GRAY8:  copyRows <PixelFormat::GRAY8> (image, first_row, stride); break;
+        case PixelFormat::GRAY16: copyRows <PixelFormat::GRAY16> (image, first_row, stride); break;
+        case PixelFormat::RGB16:  copyRows <PixelFormat::RGB16> (image, first_row, stride); break;
+        case PixelFormat::RGBA16: copyRows <PixelFormat::RGBA16> (image, first_row, stride); break;
+        case PixelFormat::RGBF32: copyRows <PixelFormat::RGBF32> (image, first_row, stride); break;
+    }
+}
+
+// Pixels wrapped in memory of the caller's, stored either way up with padded
+// rows, read and encode like an image of their own; writes to the wrapper
+// land in that memory and writes to its copies do not.
+static void testWrapped()
+{
+    static const PixelFormat formats[] = {
+        PixelFormat::BGR8, PixelFormat::RGB8, PixelFormat::BGRA8, PixelFormat::GRAY8,
+        PixelFormat::GRAY16, PixelFormat::RGB16, PixelFormat::RGBF32, PixelFormat::RGBA16
+    };
+    const int width = 21;
+    const int height = 11;
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        for (int bottom_up = 0; bottom_up < 2; bottom_up++)
+        {
+            Bitmap owned = makeImage(width, height, 29 + f);
+            owned.convert(formats[f]);
+
+            // Padding that keeps every channel aligned, and memory that
+            // keeps the first byte aligned for any of them.
+            const std::ptrdiff_t pitch = width * pixelFormatSize(formats[f]) + 12;
+            std::vector <uint32_t> memory((pitch * height + 3) / 4);
+            unsigned char * base = (unsigned char *)(&memory[0]);
+            unsigned char * first_row = bottom_up ? base + pitch * (height - 1) : base;
+            const std::ptrdiff_t stride = bottom_up ? -pitch : pitch;
+            copyRows(owned, first_row, stride);
+
+            const Bitmap wrapped(first_row, width, height, stride, formats[f]);
+            CHECK(wrapped.isImage() && samePixels(wrapped, owned));
+
+            std::vector <unsigned char> expected;
+            std::vector <unsigned char> actual;
+            owned.encode(expected);
+            wrapped.encode(actual);
+            CHECK(actual == expected);
+        }
+    }
+
+    std::vector <uint32_t> memory(64 * 8);
+    unsigned char * bytes = (unsigned char *)(&memory[0]);
+    {
+        QuietCout quiet;
+        CHECK(!Bitmap(NULL, 4, 4, 12).isImage());
+        CHECK(!Bitmap(bytes, 4, 4, 11).isImage());
+        CHECK(!Bitmap(bytes + 44, 4, 4, -11).isImage());
+        CHECK(!Bitmap(bytes + 1, 4, 4, 24, PixelFormat::RGB16).isImage());
+        CHECK(!Bitmap(bytes, 4, 4, 25, PixelFormat::RGB16).isImage());
+    }
+
+    // A bottom-up BGR8 frame with 4 bytes of padding on each row.
+    Bitmap wrapped(bytes + 16 * 3, 4, 4, -16);
+    CHECK(wrapped.isImage());
+    wrapped.pixel(1, 2).green = 77;
+    CHECK(bytes[16 * 2 + 2 * 3 + 1] == 77);
+
+    const std::vector <uint32_t> before = memory;
+    Bitmap copy = wrapped;
+    copy.pixel(1, 2).green = 99;
+    copy.pixel(3, 0).red = 5;
+    CHECK(memory == before);
+    CHECK(wrapped.pixel(1, 2).green == 77 && copy.pixel(1, 2).green == 99);
+}
+
+// The pixels of a rectangle wholly within an image.
+static Bitmap crop(const Bitmap & image, int x, int y, int width, int height)
+{
+    Bitmap part(width, height);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            part.pixel(row, col) = image.pixel(y + row, x + col);
+        }
+    }
+    return part;
+}
+
+// openRegion reads crops of files stored either way up, clipped to the
+// image, and nothing at all for regions outside it.
+static void testRegions()
+{
+    const Bitmap image = makeImage(31, 17, 41);
+
+    // The region asked for and the part of the image it covers.
+    static const int regions[][8] = {
+        { 5, 3, 10, 7,                  5, 3, 10, 7 },
+        { 0, 16, 31, 1,                 0, 16, 31, 1 },
+        { -4, -2, 9, 6,                 0, 0, 5, 4 },
+        { 25, 12, 100, 100,             25, 12, 6, 5 },
+        { -1, -1, 40, 40,               0, 0, 31, 17 },
+        { 3, 2, INT_MAX, INT_MAX,       3, 2, 28, 15 },
+        { INT_MIN, 9, INT_MAX, 3,       0, 9, 0, 0 },
+        { 31, 0, 5, 5,                  0, 0, 0, 0 },
+        { 0, -10, 5, 10,                0, 0, 0, 0 },
+        { 4, 4, 0, 3,                   0, 0, 0, 0 }
+    };
+
+    for (int bottom_up = 0; bottom_up < 2; bottom_up++)
+    {
+        BitmapWriter writer;
+        writer.open(FILE_NAME, image.width(), image.height(), bottom_up != 0);
+        for (int y = 0; y < image.height(); y++)
+        {
+            CHECK(writer.writeRow(y, image.view <PixelFormat::BGR8> ().row(y)));
+        }
+        writer.close();
+        CHECK(Bitmap::probe(FILE_NAME).bottom_up == (bottom_up != 0));
+
+        for (size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); r++)
+        {
+            const int * region = regions[r];
+            QuietCout quiet;
+            Bitmap part;
+            part.openRegion(FILE_NAME, region[0], region[1], region[2], region[3]);
+
+            if (region[6] == 0)
+            {
+                CHECK(!part.isImage());
+            }
+            else
+            {
+                CHECK(samePixels(part,
+                                 crop(image, region[4], region[5], region[6], region[7])));
+            }
+        }
+    }
+}
+
+// The largest difference between any channel of two BGR8 images.
+static int largestError(const Bitmap & a, const Bitmap & b)
+{
+    int error = 0;
+    for (int y = 0; y < a.height(); y++)
+    {
+        for (int x = 0; x < a.width(); x++)
+        {
+            error = std::max(error, std::abs(a.pixel(y, x).red - b.pixel(y, x).red));
+            error = std::max(error, std::abs(a.pixel(y, x).green - b.pixel(y, x).green));
+            error = std::max(error, std::abs(a.pixel(y, x).blue - b.pixel(y, x).blue));
+        }
+    }
+    return error;
+}
+
+// 16-bit files stay within a step of their fields, and rounded ones
+// reproduce themselves when what was read from them is saved again.
+static void testPacked()
+{
+    static const PackedFormat packed[] = { PackedFormat::RGB555, PackedFormat::RGB565 };
+
+    for (int p = 0; p < 2; p++)
+    {
+        for (int dither = 0; dither < 2; dither++)
+        {
+            const Bitmap image = makeImage(45, 17, 11);
+
+            BitmapSaveOptions options;
+            options.packed = packed[p];
+            options.dither = dither != 0;
+
+            const std::vector <unsigned char> file = saveAndEncode(image, options);
+            const Bitmap back = readBack(file);
+            CHECK(back.format() == PixelFormat::BGR8);
+            CHECK(largestError(back, image) <= (dither ? 8 : 4));
+
+            if (!dither)
+            {
+                CHECK(saveAndEncode(back, options) == file);
+            }
+        }
+    }
+}
+
+// BitmapWriter files hold every row, black where none was written, and
+// read back the same whichever way up they are stored.
+static void testWriter()
+{
+    const Bitmap image = makeImage(29, 12, 17);
+
+    for (int bottom_up = 0; bottom_up < 2; bottom_up++)
+    {
+        // Only even rows are written, and the last row is never reached.
+        BitmapWriter writer;
+        writer.open(FILE_NAME, image.width(), image.height(), bottom_up != 0);
+        for (int y = 0; y < image.height(); y += 2)
+        {
+            CHECK(writer.writeRow(y, image.view <PixelFormat::BGR8> ().row(y)));
+        }
+        writer.close();
+
+        Bitmap expected = image;
+        for (int y = 1; y < image.height(); y += 2)
+        {
+            for (int x = 0; x < image.width(); x++)
+            {
+                expected.pixel(y, x) = PackedPixel();
+            }
+        }
+
+        CHECK(readFile(FILE_NAME).size() == image.encode(NULL, 0));
+        Bitmap back;
+        back.open(FILE_NAME);
+        CHECK(samePixels(back, expected));
+    }
+}
+
+int main()
+{
+    testFormats();
+    testIndexed();
+    testDefaultReaders();
+    testRegions();
+    testReaderWindows();
+    testPacked();
+    testWriter();
+    testWrapped();
+    std::remove(FILE_NAME);
+    return checkResult();
+}
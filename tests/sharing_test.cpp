@@ -0,0 +1,126 @@
+#include "check.h"
+
+#include <cstdio>
+
+// ----------------------------------------------------------------------------
+// Copies of a Bitmap share its pixels until one of them is written to. Checks
+// that a copy costs no pixels, that writing to or reshaping any copy leaves
+// the others as they were, and that reading and saving leave them shared.
+
+static const char * const FILE_NAME = "sharing_test.bmp";
+
+// Whether two images hold their pixels in the same memory.
+static bool sharePixels(const Bitmap & a, const Bitmap & b)
+{
+    return a.row(0) != NULL && a.row(0) == b.row(0);
+}
+
+// Writes through either of two copies reach only the one written to.
+static void testWrites()
+{
+    const Bitmap original = makeImage(17, 9, 3);
+    Bitmap a = original;
+    Bitmap b = a;
+    Bitmap c;
+    c = b;
+    CHECK(sharePixels(a, original) && sharePixels(b, original) && sharePixels(c, original));
+
+    b.pixel(4, 5).green ^= 0xFF;
+    CHECK(!sharePixels(b, original) && sharePixels(a, original));
+    CHECK(samePixels(a, original) && samePixels(c, original) && !samePixels(b, original));
+
+    // Once a copy has pixels of its own, it writes to them in place.
+    a.pixel(0, 0).red ^= 0xFF;
+    c.pixel(0, 0).blue ^= 0xFF;
+    const PackedPixel * before = static_cast <const Bitmap &> (c).row(0);
+    c.pixel(1, 1).blue ^= 0xFF;
+    CHECK(static_cast <const Bitmap &> (c).row(0) == before);
+    CHECK(samePixels(original, makeImage(17, 9, 3)));
+
+    // Writes through a view and a channel detach the same way.
+    Bitmap d = original;
+    d.view <PixelFormat::BGR8> ().pixel(2, 2).red ^= 0xFF;
+    Bitmap e = original;
+    e.channel <PixelFormat::BGR8> (PixelFormatTraits <PixelFormat::BGR8>::blue)
+            .sample(3, 3) ^= 0xFF;
+    CHECK(!samePixels(d, original) && !samePixels(e, original));
+    CHECK(samePixels(original, makeImage(17, 9, 3)));
+}
+
+// convert and setLayout on a copy give it pixels of its own.
+static void testReshaping()
+{
+    const Bitmap original = makeImage(23, 6, 5);
+
+    Bitmap gray = original;
+    gray.convert(PixelFormat::GRAY8);
+    CHECK(gray.format() == PixelFormat::GRAY8);
+    CHECK(original.format() == PixelFormat::BGR8);
+
+    Bitmap planar = original;
+    planar.setLayout(PixelLayout::PLANAR);
+    planar.channel <PixelFormat::BGR8> (PixelFormatTraits <PixelFormat::BGR8>::red)
+            .sample(0, 0) ^= 0xFF;
+    CHECK(planar.layout() == PixelLayout::PLANAR);
+    CHECK(original.layout() == PixelLayout::INTERLEAVED);
+
+    Bitmap wide = original;
+    wide.convert(PixelFormat::RGB16);
+    wide.convert(PixelFormat::BGR8);
+    CHECK(samePixels(wide, original));
+
+    CHECK(samePixels(original, makeImage(23, 6, 5)));
+}
+
+// The channels of a const copy are read where they lie, in either layout.
+static void testConstChannels()
+{
+    typedef PixelFormatTraits <PixelFormat::BGR8> Traits;
+
+    for (int planar = 0; planar < 2; planar++)
+    {
+        Bitmap original = makeImage(14, 5, 7);
+        original.setLayout(planar ? PixelLayout::PLANAR : PixelLayout::INTERLEAVED);
+        const Bitmap copy = original;
+
+        const Bitmap & reader = original;
+        const ChannelView <const uint8_t> green = copy.channel <PixelFormat::BGR8> (Traits::green);
+        const ChannelView <const uint8_t> source =
+                reader.channel <PixelFormat::BGR8> (Traits::green);
+        CHECK(green.row(0) == source.row(0) && green.step() == source.step());
+        CHECK(green.sample(4, 13) == makeImage(14, 5, 7).pixel(4, 13).green);
+        CHECK(copy.channel <PixelFormat::GRAY8> (0).empty());
+
+        // Writing through the source still takes it apart from the copy.
+        original.channel <PixelFormat::BGR8> (Traits::green).sample(0, 0) ^= 0xFF;
+        CHECK(copy.channel <PixelFormat::BGR8> (Traits::green).row(0) == green.row(0));
+        CHECK(green.sample(0, 0) == makeImage(14, 5, 7).pixel(0, 0).green);
+    }
+}
+
+// Saving and encoding a copy read the pixels without taking them apart.
+static void testReading()
+{
+    const Bitmap original = makeImage(12, 7, 11);
+    Bitmap copy = original;
+
+    std::vector <unsigned char> encoded;
+    copy.encode(encoded);
+    copy.save(FILE_NAME);
+    CHECK(sharePixels(copy, original));
+    CHECK(readFile(FILE_NAME) == encoded);
+
+    Bitmap back;
+    back.open(FILE_NAME);
+    CHECK(samePixels(back, original));
+}
+
+int main()
+{
+    testWrites();
+    testReshaping();
+    testConstChannels();
+    testReading();
+    std::remove(FILE_NAME);
+    return checkResult();
+}
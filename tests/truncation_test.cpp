@@ -0,0 +1,126 @@
+#include "check.h"
+
+#include <cstdio>
+
+// ----------------------------------------------------------------------------
+// Feeds open and decode every prefix of files of each kind save writes. A
+// file cut short anywhere must give an empty image rather than a crash, a
+// read past the end or a partly filled image, and both must agree.
+
+static const char * const FILE_NAME = "truncation_test.bmp";
+
+/**
+ * Reads every prefix of a file with decode and with open.
+ *
+ * @param the complete file
+ * @param the image the complete file holds
+ * @param whether the file is RLE compressed, so that the escapes after its
+ *        last pixel may be cut off without losing any
+**/
+static void checkPrefixes(const std::vector <unsigned char> & file, const Bitmap & image,
+                          bool compressed)
+{
+    QuietCout quiet;
+
+    for (size_t size = 0; size <= file.size(); size++)
+    {
+        // A copy of just the prefix, so that reading past it is caught by
+        // tools like AddressSanitizer.
+        const std::vector <unsigned char> prefix(file.begin(), file.begin() + size);
+
+        Bitmap decoded;
+        decoded.decode(prefix.empty() ? NULL : &prefix[0], prefix.size());
+
+        writeFile(FILE_NAME, prefix);
+        Bitmap opened;
+        opened.open(FILE_NAME);
+
+        if (size == file.size())
+        {
+            CHECK(samePixels(decoded, image));
+        }
+        else if (compressed)
+        {
+            CHECK(!decoded.isImage() || samePixels(decoded, image));
+        }
+        else
+        {
+            CHECK(!decoded.isImage());
+        }
+        CHECK(decoded.isImage() == opened.isImage());
+        CHECK(!decoded.isImage() || samePixels(decoded, opened));
+    }
+}
+
+// An image of few colors whose left half is in runs RLE8 encodes and whose
+// right half is noise it leaves as literal stretches.
+static Bitmap makeRuns(int width, int height)
+{
+    Bitmap image = makeImage(width, height, 13, 20);
+    PixelView <PixelFormat::BGR8> pixels = image.view <PixelFormat::BGR8> ();
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width / 2; x++)
+        {
+            pixels.pixel(y, x) = pixels.pixel(y, x / 7 * 7);
+        }
+    }
+    return image;
+}
+
+int main()
+{
+    const Bitmap noise = makeImage(13, 5, 5);
+    const Bitmap few = makeImage(13, 5, 9, 3);
+    const Bitmap many = makeImage(13, 5, 9, 40);
+    Bitmap alpha = noise;
+    alpha.convert(PixelFormat::BGRA8);
+    Bitmap deep = noise;
+    deep.convert(PixelFormat::RGB16);
+    Bitmap deep_alpha = noise;
+    deep_alpha.convert(PixelFormat::RGBA16);
+
+    BitmapSaveOptions plain;
+    BitmapSaveOptions indexed;
+    indexed.indexed = true;
+    BitmapSaveOptions rle8;
+    rle8.rle8 = true;
+    BitmapSaveOptions rgb555;
+    rgb555.packed = PackedFormat::RGB555;
+    BitmapSaveOptions rgb565;
+    rgb565.packed = PackedFormat::RGB565;
+
+    std::vector <unsigned char> file;
+
+    noise.encode(file, plain);
+    checkPrefixes(file, noise, false);
+    few.encode(file, indexed);
+    checkPrefixes(file, few, false);
+    many.encode(file, indexed);
+    checkPrefixes(file, many, false);
+    alpha.encode(file, plain);
+    checkPrefixes(file, alpha, false);
+    deep.encode(file, plain);
+    checkPrefixes(file, deep, false);
+    deep_alpha.encode(file, plain);
+    checkPrefixes(file, deep_alpha, false);
+
+    // Packed files decode to what was read from them when complete.
+    Bitmap packed;
+    noise.encode(file, rgb555);
+    packed.decode(&file[0], file.size());
+    checkPrefixes(file, packed, false);
+    noise.encode(file, rgb565);
+    packed.decode(&file[0], file.size());
+    checkPrefixes(file, packed, false);
+
+    // Runs and literals, and a file long enough that RLE8 pays off.
+    const Bitmap runs = makeRuns(61, 7);
+    runs.encode(file, rle8);
+    CHECK(file[30] == 1);
+    checkPrefixes(file, runs, true);
+
+    std::remove(FILE_NAME);
+    return checkResult();
+}